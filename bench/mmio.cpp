@@ -0,0 +1,65 @@
+#include <chrono>
+#include <random>
+
+#include <fmt/format.h>
+
+#include "kvm/virtio/device.h"
+#include "kvm/virtio/mmio.h"
+
+// exit cost of the virtio-mmio bus lookup as the device count grows
+
+namespace {
+  class null_device : public kvm::virtio::queue_device<VIRTIO_ID_RNG, 1> {
+  public:
+    null_device(::kvm::interrupt *irq, ::kvm::memory_map *mem)
+        : queue_device<VIRTIO_ID_RNG, 1>(irq, mem) {}
+
+    std::vector<__u8> read(__u64 offset, __u32 size) override {
+      return std::vector<__u8>(size);
+    }
+
+    void write(__u8 *data, __u64 offset, __u32 size) override {}
+
+    __u32 features() override {
+      return 0;
+    }
+
+    __u32 config_generation() override {
+      return 0;
+    }
+  };
+
+  constexpr __u64 MMIO_BASE = 0xd0000000;
+  constexpr __u64 MMIO_WIDTH = 0x1000;
+  constexpr size_t ITERATIONS = 10000000;
+} // namespace
+
+int main() {
+  kvm::interrupt irq(0);
+
+  for (size_t count : {3, 8, 32, 64, 128, 256}) {
+    kvm::virtio::mmio bus;
+    for (size_t i = 0; i < count; i++) {
+      bus.add_device<null_device>(MMIO_BASE + i * MMIO_WIDTH, MMIO_WIDTH, &irq, nullptr);
+    }
+
+    std::mt19937 rng(count);
+    std::vector<__u64> addrs(4096);
+    for (auto &addr : addrs) {
+      addr = MMIO_BASE + (rng() % count) * MMIO_WIDTH + VIRTIO_MMIO_MAGIC_VALUE;
+    }
+
+    __u64 sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+      auto buf = bus.read(addrs[i % addrs.size()], 4);
+      sum += buf[0];
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    fmt::print("devices {:4} {:6.1f} ns/exit (checksum {})\n", count, double(ns) / ITERATIONS, sum);
+  }
+
+  return 0;
+}
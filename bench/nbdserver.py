@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+# a small nbd server backed by an image file, a local stand-in for
+# nbdkit or qemu-nbd when trying out the nbd backend:
+#
+#   bench/nbdserver.py <unix path | tcp:port> <image> [options]
+#   build/bench/replay <trace> unix:<path>,backend=nbd,connections=4
+#
+# replies go out of order and structured reads come back in shuffled
+# chunks with zero chunks as holes, so the client's reply matching gets
+# exercised. the options drop transmission flags to cover the client's
+# fallbacks.
+
+import argparse
+import os
+import random
+import select
+import socket
+import struct
+import sys
+import threading
+
+NBDMAGIC = b"NBDMAGIC"
+IHAVEOPT = 0x49484156454F5054
+OPTION_REPLY_MAGIC = 0x3E889045565A9
+REQUEST_MAGIC = 0x25609513
+SIMPLE_REPLY_MAGIC = 0x67446698
+STRUCTURED_REPLY_MAGIC = 0x668E33EF
+
+OPT_GO = 7
+OPT_STRUCTURED_REPLY = 8
+REP_ACK = 1
+REP_INFO = 3
+REP_ERR_UNSUP = (1 << 31) | 1
+
+FLAG_HAS_FLAGS = 1 << 0
+FLAG_SEND_FLUSH = 1 << 2
+FLAG_SEND_FUA = 1 << 3
+FLAG_SEND_TRIM = 1 << 5
+FLAG_SEND_WRITE_ZEROES = 1 << 6
+FLAG_CAN_MULTI_CONN = 1 << 8
+
+CMD_READ, CMD_WRITE, CMD_DISC, CMD_FLUSH, CMD_TRIM, CMD_WRITE_ZEROES = 0, 1, 2, 3, 4, 6
+CMD_NAMES = {0: "read", 1: "write", 3: "flush", 4: "trim", 6: "write_zeroes"}
+CMD_FLAG_FUA = 1 << 0
+
+REPLY_FLAG_DONE = 1 << 0
+REPLY_TYPE_NONE = 0
+REPLY_TYPE_OFFSET_DATA = 1
+REPLY_TYPE_OFFSET_HOLE = 2
+REPLY_TYPE_ERROR = (1 << 15) | 1
+
+CHUNK = 512
+EINVAL = 22
+
+
+def recvall(s, n):
+    buf = b""
+    while len(buf) < n:
+        part = s.recv(n - len(buf))
+        if not part:
+            raise EOFError
+        buf += part
+    return buf
+
+
+class export:
+    def __init__(self, args):
+        self.args = args
+        self.fd = os.open(args.image, os.O_RDWR)
+        self.size = os.fstat(self.fd).st_size
+        self.lock = threading.Lock()
+
+        self.flags = FLAG_HAS_FLAGS | FLAG_SEND_TRIM
+        if not args.no_flush:
+            self.flags |= FLAG_SEND_FLUSH
+            if not args.no_fua:
+                self.flags |= FLAG_SEND_FUA
+        if not args.no_write_zeroes:
+            self.flags |= FLAG_SEND_WRITE_ZEROES
+        if not args.no_multi_conn:
+            self.flags |= FLAG_CAN_MULTI_CONN
+
+    def run(self, flags, cmd, offset, length, data):
+        if self.args.verbose:
+            fua = " fua" if flags & CMD_FLAG_FUA else ""
+            print(f"{CMD_NAMES.get(cmd, cmd)} {offset:#x} {length}{fua}", flush=True)
+        if offset + length > self.size:
+            return EINVAL, b""
+
+        with self.lock:
+            if cmd == CMD_READ:
+                return 0, os.pread(self.fd, length, offset)
+            if cmd == CMD_WRITE:
+                os.pwrite(self.fd, data, offset)
+                if flags & CMD_FLAG_FUA:
+                    os.fdatasync(self.fd)
+            elif cmd == CMD_FLUSH:
+                os.fdatasync(self.fd)
+            elif cmd in (CMD_TRIM, CMD_WRITE_ZEROES):
+                os.pwrite(self.fd, bytes(length), offset)
+            else:
+                return EINVAL, b""
+        return 0, b""
+
+
+class client:
+    def __init__(self, exp, sock):
+        self.exp = exp
+        self.s = sock
+        self.structured = False
+
+    def negotiate(self):
+        s = self.s
+        s.sendall(NBDMAGIC + struct.pack(">QH", IHAVEOPT, 3))
+        recvall(s, 4)
+        while True:
+            _, opt, length = struct.unpack(">QII", recvall(s, 16))
+            recvall(s, length)
+
+            def reply(kind, data=b""):
+                s.sendall(struct.pack(">QIII", OPTION_REPLY_MAGIC, opt, kind, len(data)) + data)
+
+            if opt == OPT_STRUCTURED_REPLY and not self.exp.args.simple:
+                self.structured = True
+                reply(REP_ACK)
+            elif opt == OPT_GO:
+                reply(REP_INFO, struct.pack(">HQH", 0, self.exp.size, self.exp.flags))
+                reply(REP_ACK)
+                return
+            else:
+                reply(REP_ERR_UNSUP)
+
+    def serve(self):
+        self.negotiate()
+        pending = []
+        while True:
+            # take everything already sent, so replies go out of order
+            ready, _, _ = select.select([self.s], [], [], 0 if pending else None)
+            if ready:
+                magic, flags, cmd, handle, offset, length = struct.unpack(">IHHQQI", recvall(self.s, 28))
+                if magic != REQUEST_MAGIC:
+                    return
+                if cmd == CMD_DISC:
+                    return
+                data = recvall(self.s, length) if cmd == CMD_WRITE else b""
+                pending.append((flags, cmd, handle, offset, length, data))
+                continue
+
+            random.shuffle(pending)
+            for flags, cmd, handle, offset, length, data in pending:
+                error, out = self.exp.run(flags, cmd, offset, length, data)
+                if self.structured and cmd == CMD_READ:
+                    self.reply_chunks(handle, offset, error, out)
+                else:
+                    self.s.sendall(struct.pack(">IIQ", SIMPLE_REPLY_MAGIC, error, handle) + out)
+            pending = []
+
+    def reply_chunks(self, handle, offset, error, out):
+        def chunk(flags, kind, payload):
+            self.s.sendall(struct.pack(">IHHQI", STRUCTURED_REPLY_MAGIC, flags, kind, handle, len(payload)) + payload)
+
+        if error:
+            chunk(REPLY_FLAG_DONE, REPLY_TYPE_ERROR, struct.pack(">IH", error, 0))
+            return
+        if not out:
+            chunk(REPLY_FLAG_DONE, REPLY_TYPE_NONE, b"")
+            return
+
+        parts = [(pos, out[pos:pos + CHUNK]) for pos in range(0, len(out), CHUNK)]
+        random.shuffle(parts)
+        for n, (pos, data) in enumerate(parts):
+            flags = REPLY_FLAG_DONE if n == len(parts) - 1 else 0
+            if data.count(0) == len(data):
+                chunk(flags, REPLY_TYPE_OFFSET_HOLE, struct.pack(">QI", offset + pos, len(data)))
+            else:
+                chunk(flags, REPLY_TYPE_OFFSET_DATA, struct.pack(">Q", offset + pos) + data)
+
+    def run(self):
+        try:
+            self.serve()
+        except (EOFError, ConnectionError):
+            pass
+        finally:
+            self.s.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="nbd stand-in server backed by an image file")
+    parser.add_argument("address", help="unix socket path or tcp:<port>")
+    parser.add_argument("image")
+    parser.add_argument("--simple", action="store_true", help="refuse structured replies")
+    parser.add_argument("--no-multi-conn", action="store_true")
+    parser.add_argument("--no-flush", action="store_true", help="no flush and no fua")
+    parser.add_argument("--no-fua", action="store_true")
+    parser.add_argument("--no-write-zeroes", action="store_true")
+    parser.add_argument("-v", "--verbose", action="store_true", help="print every command")
+    args = parser.parse_args()
+
+    exp = export(args)
+    if args.address.startswith("tcp:"):
+        srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.bind(("127.0.0.1", int(args.address[4:])))
+    else:
+        if os.path.exists(args.address):
+            os.unlink(args.address)
+        srv = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        srv.bind(args.address)
+    srv.listen(16)
+    print(f"serving {args.image} on {args.address}", file=sys.stderr, flush=True)
+
+    while True:
+        sock, _ = srv.accept()
+        threading.Thread(target=client(exp, sock).run, daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
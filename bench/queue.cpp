@@ -0,0 +1,158 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "kvm/virtio/queue.h"
+
+// drives a virtqueue from a driver and a device thread, once with the
+// split and once with the packed ring layout
+
+namespace {
+  using kvm::virtio::load_acquire;
+  using kvm::virtio::queue;
+  using kvm::virtio::store_release;
+
+  constexpr __u32 QUEUE_SIZE = 256;
+  constexpr __u64 DESC_ADDR = 0x0;
+  constexpr __u64 AVAIL_ADDR = 0x4000;
+  constexpr __u64 USED_ADDR = 0x8000;
+  constexpr __u64 MEMORY_SIZE = 0x10000;
+  constexpr size_t ITERATIONS = 20000000;
+
+  constexpr __u16 PACKED_AVAIL = 1 << VRING_PACKED_DESC_F_AVAIL;
+  constexpr __u16 PACKED_USED = 1 << VRING_PACKED_DESC_F_USED;
+
+  // plays the guest side: publishes descriptors and reaps used elements
+  void split_driver(queue &q) {
+    auto avail = q.avail();
+    auto used = q.used();
+
+    __u16 avail_idx = 0;
+    __u16 last_used = 0;
+    size_t submitted = 0;
+    size_t completed = 0;
+
+    while (completed < ITERATIONS) {
+      while (__u16(avail_idx - last_used) < QUEUE_SIZE && submitted < ITERATIONS) {
+        const __u16 id = avail_idx % QUEUE_SIZE;
+        q.desc()->ring[id] = {0, 64, 0, 0};
+        avail->ring[id] = id;
+        store_release(&avail->idx, ++avail_idx);
+        submitted++;
+      }
+
+      const __u16 used_idx = load_acquire(&used->idx);
+      if (used_idx == last_used) {
+        std::this_thread::yield();
+        continue;
+      }
+      completed += __u16(used_idx - last_used);
+      last_used = used_idx;
+    }
+  }
+
+  void packed_driver(queue &q) {
+    auto ring = q.packed_desc()->ring;
+
+    __u16 avail_idx = 0;
+    bool avail_wrap = true;
+    __u16 used_idx = 0;
+    bool used_wrap = true;
+
+    size_t in_flight = 0;
+    size_t submitted = 0;
+    size_t completed = 0;
+
+    while (completed < ITERATIONS) {
+      while (in_flight < QUEUE_SIZE && submitted < ITERATIONS) {
+        ring[avail_idx].addr = 0;
+        ring[avail_idx].len = 64;
+        ring[avail_idx].id = avail_idx;
+        store_release(&ring[avail_idx].flags, __u16(avail_wrap ? PACKED_AVAIL : PACKED_USED));
+
+        if (++avail_idx == QUEUE_SIZE) {
+          avail_idx = 0;
+          avail_wrap = !avail_wrap;
+        }
+        in_flight++;
+        submitted++;
+      }
+
+      bool reaped = false;
+      while (in_flight) {
+        const __u16 flags = load_acquire(&ring[used_idx].flags);
+        if (bool(flags & PACKED_USED) != used_wrap || bool(flags & PACKED_AVAIL) != used_wrap) {
+          break;
+        }
+
+        if (++used_idx == QUEUE_SIZE) {
+          used_idx = 0;
+          used_wrap = !used_wrap;
+        }
+        in_flight--;
+        completed++;
+        reaped = true;
+      }
+
+      if (!reaped) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void device(queue &q) {
+    std::vector<queue::chain_t> chains;
+
+    size_t served = 0;
+    while (served < ITERATIONS) {
+      const size_t count = q.next_batch(chains, QUEUE_SIZE);
+      if (count == 0) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        chains[i].len = kvm::iov_length(chains[i].readable);
+      }
+      q.add_used_batch(chains, count);
+      served += count;
+    }
+  }
+
+  void run(bool packed) {
+    std::vector<__u8> memory(MEMORY_SIZE);
+    kvm::memory_map mem;
+    mem.add_region(0, MEMORY_SIZE, memory.data());
+
+    queue q(&mem);
+    q.size = QUEUE_SIZE;
+    q.packed = packed;
+    q.desc_addr = DESC_ADDR;
+    q.avail_addr = AVAIL_ADDR;
+    q.used_addr = USED_ADDR;
+    q.set_ready();
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread device_thread(device, std::ref(q));
+    std::thread driver_thread(packed ? packed_driver : split_driver, std::ref(q));
+    device_thread.join();
+    driver_thread.join();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    fmt::print("{:6} {} requests {:.1f} ns/request {:.2f} Mreq/s\n",
+               packed ? "packed" : "split",
+               ITERATIONS,
+               double(ns) / ITERATIONS,
+               ITERATIONS * 1e3 / ns);
+  }
+} // namespace
+
+int main() {
+  run(false);
+  run(true);
+  return 0;
+}
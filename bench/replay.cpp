@@ -0,0 +1,180 @@
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <poll.h>
+
+#include "kvm/block/block.h"
+
+// replays an io trace recorded by virtio::blk (io_trace=<path>) against
+// any disk spec, without a guest:
+//
+//   replay <trace> <disk spec> [depth]
+//
+// without a depth requests are issued at their recorded times, with one
+// they are issued back to back keeping depth of them in flight. writes
+// carry garbage, replay against a scratch copy of the image.
+
+namespace {
+  using kvm::block::io_trace;
+  using clock = std::chrono::steady_clock;
+
+  constexpr size_t TIMED_DEPTH = 256;
+  constexpr __u64 BUFFER_ALIGN = 4096;
+
+  constexpr size_t OPS = 5;
+  constexpr const char *OP_NAMES[OPS] = {"read", "write", "flush", "discard", "write_zeroes"};
+
+  struct slot : kvm::block::request {
+    __u8 *buf = nullptr;
+    clock::time_point issued;
+  };
+
+  __u64 ns(clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+  }
+
+  void prepare(slot &s, const io_trace::record &rec) {
+    s.type = kvm::block::op(rec.type);
+    s.offset = rec.sector * 512;
+    s.iov.clear();
+    s.extents.clear();
+    s.fua = false;
+    s.result = 0;
+
+    switch (s.type) {
+    case kvm::block::op::read:
+    case kvm::block::op::write:
+      s.iov.push_back({s.buf, rec.len});
+      break;
+    case kvm::block::op::flush:
+      break;
+    case kvm::block::op::discard:
+    case kvm::block::op::write_zeroes:
+      s.extents.push_back({s.offset, rec.len, false});
+      break;
+    }
+  }
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fmt::print("usage: {} <trace> <disk spec> [depth]\n", argv[0]);
+    return 1;
+  }
+
+  const auto records = io_trace::load(argv[1]);
+  auto disk = kvm::block::open_disk(kvm::block::options::parse(argv[2]));
+  const bool timed = argc < 4;
+  const size_t depth = timed ? TIMED_DEPTH : std::max(std::stoul(argv[3]), 1ul);
+  const __u64 disk_size = disk->size();
+
+  __u64 max_len = BUFFER_ALIGN;
+  for (const auto &rec : records) {
+    max_len = std::max<__u64>(max_len, rec.len);
+  }
+  max_len = (max_len + BUFFER_ALIGN - 1) & ~(BUFFER_ALIGN - 1);
+
+  // aligned so the disk may be opened with O_DIRECT
+  std::vector<slot> slots(depth);
+  std::vector<slot *> free_slots;
+  for (auto &s : slots) {
+    s.buf = static_cast<__u8 *>(aligned_alloc(BUFFER_ALIGN, max_len));
+    if (s.buf == nullptr) {
+      fmt::print("could not allocate {} byte buffers\n", max_len);
+      return 1;
+    }
+    free_slots.push_back(&s);
+  }
+
+  std::array<kvm::block::histogram, OPS> recorded;
+  std::array<kvm::block::histogram, OPS> replayed;
+  __u64 bytes = 0;
+  size_t errors = 0;
+  size_t skipped = 0;
+
+  std::vector<kvm::block::request *> done;
+  size_t next = 0;
+  const auto start = clock::now();
+
+  while (next < records.size() || free_slots.size() < depth) {
+    const clock::time_point now = clock::now();
+    while (next < records.size() && !free_slots.empty()) {
+      const io_trace::record &rec = records[next];
+      if (timed && start + std::chrono::nanoseconds(rec.time) > now) {
+        break;
+      }
+      next++;
+
+      if (rec.sector * 512 + rec.len > disk_size) {
+        skipped++;
+        continue;
+      }
+
+      slot *s = free_slots.back();
+      free_slots.pop_back();
+      prepare(*s, rec);
+      s->issued = now;
+      recorded[rec.type].record(rec.latency);
+      disk->submit(s);
+    }
+    disk->flush_submissions();
+
+    done.clear();
+    if (disk->reap(done) == 0) {
+      // sleep until the next completion or the next request is due
+      int timeout = free_slots.size() < depth ? 100 : 0;
+      if (timed && next < records.size() && !free_slots.empty()) {
+        const auto due = start + std::chrono::nanoseconds(records[next].time);
+        timeout = std::max<int>(0, std::chrono::duration_cast<std::chrono::milliseconds>(due - clock::now()).count());
+        if (free_slots.size() == depth) {
+          std::this_thread::sleep_until(due);
+          continue;
+        }
+      }
+
+      const int fd = disk->event_fd();
+      if (fd >= 0 && timeout > 0) {
+        pollfd pfd = {fd, POLLIN, 0};
+        poll(&pfd, 1, timeout);
+      }
+      continue;
+    }
+
+    const clock::time_point completed = clock::now();
+    for (kvm::block::request *r : done) {
+      slot *s = static_cast<slot *>(r);
+      replayed[size_t(s->type)].record(ns(completed - s->issued));
+      if (s->result < 0) {
+        errors++;
+      } else {
+        bytes += s->result;
+      }
+      free_slots.push_back(s);
+    }
+  }
+
+  const auto end = clock::now();
+  const double seconds = ns(end - start) / 1e9;
+  const size_t issued = records.size() - skipped;
+
+  fmt::print("{} requests in {:.3f} s, {:.0f} iops {:.1f} MB/s, {} errors, {} past the end of the disk\n",
+             issued, seconds, issued / seconds, bytes / seconds / 1e6, errors, skipped);
+  for (size_t i = 0; i < OPS; i++) {
+    if (replayed[i].count() == 0) {
+      continue;
+    }
+    fmt::print("{:12} recorded p50 {} p99 {} ns, replayed p50 {} p99 {} ns\n", OP_NAMES[i],
+               recorded[i].percentile(50), recorded[i].percentile(99),
+               replayed[i].percentile(50), replayed[i].percentile(99));
+  }
+
+  for (auto &s : slots) {
+    free(s.buf);
+  }
+  return errors != 0;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+
+#include "boot_trace.h"
+#include "cache_disk.h"
+#include "disk.h"
+#include "fstream_disk.h"
+#include "io_trace.h"
+#include "mmap_disk.h"
+#include "nbd_disk.h"
+#include "options.h"
+#include "overlay_disk.h"
+#include "stats.h"
+#include "throttle.h"
+#include "uring_disk.h"
+
+namespace kvm::block {
+
+  inline std::unique_ptr<disk> open_backend(const options &opts) {
+    switch (opts.backend) {
+    case backend_type::fstream:
+      return std::make_unique<fstream_disk>(opts.path);
+    case backend_type::uring:
+      return std::make_unique<uring_disk>(opts.path, opts.direct, opts.readonly);
+    case backend_type::overlay:
+      return std::make_unique<overlay_disk>(opts.path, opts.base, opts.cache == cache_mode::writeback);
+    case backend_type::mmap:
+      return std::make_unique<mmap_disk>(opts.path, opts.readonly);
+    case backend_type::nbd: {
+      auto disk = std::make_unique<nbd_disk>(opts.path, opts.export_name, opts.connections, opts.readonly);
+      // every queue opens connections of its own
+      if (opts.queues > 1 && !disk->multi_conn())
+        throw std::runtime_error(fmt::format("nbd server {} does not allow multiple queues", opts.path));
+      return disk;
+    }
+    }
+    throw std::runtime_error("invalid disk backend");
+  }
+
+  inline std::unique_ptr<disk> open_disk(const options &opts) {
+    auto backend = open_backend(opts);
+    if (opts.cache_size) {
+      return std::make_unique<cache_disk>(std::move(backend), opts.cache_size);
+    }
+    return backend;
+  }
+
+} // namespace kvm::block
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <asm/types.h>
+
+#include "disk.h"
+
+namespace kvm::block {
+
+  // sidecar file of the reads a guest issued while booting, one
+  // "sector count" line per request in submission order
+  class boot_trace {
+  public:
+    // reads larger than this are split when prefetching
+    static constexpr __u64 PREFETCH_CHUNK = 256 << 10;
+
+    // logs reads for the first seconds after the recorder is created
+    class recorder {
+    public:
+      recorder(const std::string &filename, __u32 seconds)
+          : file(filename, std::ios::out | std::ios::trunc)
+          , deadline(std::chrono::steady_clock::now() + std::chrono::seconds(seconds)) {
+        if (!file.is_open())
+          throw std::runtime_error(fmt::format("could not open file {}", filename));
+      }
+
+      void record(__u64 offset, __u64 len) {
+        const std::lock_guard<std::mutex> lock(mu);
+        if (!file.is_open()) {
+          return;
+        }
+
+        if (std::chrono::steady_clock::now() >= deadline) {
+          file.close();
+          return;
+        }
+        file << (offset / 512) << ' ' << (len / 512) << '\n';
+      }
+
+    private:
+      std::mutex mu;
+      std::ofstream file;
+      std::chrono::steady_clock::time_point deadline;
+    };
+
+    // the recorded reads in order, with back to back reads merged and
+    // everything cut into chunks no larger than PREFETCH_CHUNK
+    static std::vector<extent> load(const std::string &filename, __u64 disk_size) {
+      std::ifstream file(filename);
+      if (!file.is_open())
+        throw std::runtime_error(fmt::format("could not open file {}", filename));
+
+      std::vector<extent> extents;
+      __u64 sector, count;
+      while (file >> sector >> count) {
+        const __u64 offset = sector * 512;
+        if (count == 0 || offset >= disk_size) {
+          continue;
+        }
+        __u64 pos = offset;
+        __u64 len = std::min(count * 512, disk_size - offset);
+
+        if (!extents.empty()) {
+          extent &last = extents.back();
+          if (last.offset + last.len == offset && last.len < PREFETCH_CHUNK) {
+            const __u64 grow = std::min(len, PREFETCH_CHUNK - last.len);
+            last.len += grow;
+            pos += grow;
+            len -= grow;
+          }
+        }
+
+        while (len) {
+          const __u64 chunk = std::min(len, PREFETCH_CHUNK);
+          extents.push_back({pos, chunk, false});
+          pos += chunk;
+          len -= chunk;
+        }
+      }
+      return extents;
+    }
+  };
+
+} // namespace kvm::block
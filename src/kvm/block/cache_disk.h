@@ -0,0 +1,381 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <asm/types.h>
+
+#include "kvm/memory.h"
+
+#include "disk.h"
+
+namespace kvm::block {
+
+  // page cache in front of another disk, for images opened with O_DIRECT
+  // or on storage the host page cache does not help with.
+  //
+  // pages are replaced with CLOCK and the cache is write-through: writes
+  // drop the pages they cover and go straight to the inner disk, fills
+  // racing with a write are not cached. reads
+  // that miss any page fill the whole page span from the inner disk and
+  // complete once that fill does. sequential streams read ahead with a
+  // window that doubles while the stream keeps going.
+  class cache_disk : public disk {
+  public:
+    static constexpr __u64 CACHE_PAGE = 4096;
+    static constexpr __u64 READAHEAD_MIN = 128 << 10;
+    static constexpr __u64 READAHEAD_MAX = 2 << 20;
+    static constexpr size_t STREAMS = 4;
+
+    struct cache_stats {
+      std::atomic<__u64> hits{0};
+      std::atomic<__u64> misses{0};
+      std::atomic<__u64> readahead{0};
+      std::atomic<__u64> evictions{0};
+    };
+
+    cache_disk(std::unique_ptr<disk> inner, __u64 budget)
+        : inner(std::move(inner))
+        , disk_size(this->inner->size())
+        , frames(std::max<__u64>(budget / CACHE_PAGE, 1))
+        , memory(frames.size() * CACHE_PAGE) {}
+
+    __u64 size() override {
+      return disk_size;
+    }
+
+    void submit(request *req) override {
+      switch (req->type) {
+      case op::read:
+        read(req);
+        break;
+
+      case op::write:
+        invalidate(req->offset, iov_length(req->iov));
+        writes.insert(req);
+        inner->submit(req);
+        break;
+
+      case op::discard:
+      case op::write_zeroes:
+        for (const auto &ext : req->extents) {
+          invalidate(ext.offset, ext.len);
+        }
+        writes.insert(req);
+        inner->submit(req);
+        break;
+
+      case op::flush:
+        inner->submit(req);
+        break;
+      }
+    }
+
+    void flush_submissions() override {
+      inner->flush_submissions();
+    }
+
+    size_t reap(std::vector<request *> &done) override {
+      const size_t before = done.size();
+
+      reaped.clear();
+      inner->reap(reaped);
+      for (request *req : reaped) {
+        auto it = fills.find(req);
+        if (it == fills.end()) {
+          writes.erase(req);
+          done.push_back(req);
+          continue;
+        }
+
+        finish_fill(*it->second, done);
+        fills.erase(it);
+      }
+
+      done.insert(done.end(), completed.begin(), completed.end());
+      completed.clear();
+      return done.size() - before;
+    }
+
+    int event_fd() override {
+      return inner->event_fd();
+    }
+
+    const cache_stats &stats() {
+      return counters;
+    }
+
+  private:
+    // a read of whole pages from the inner disk, on behalf of a guest
+    // read or as readahead
+    struct fill : request {
+      ~fill() {
+        free(buf);
+      }
+
+      // guest reads completed from this fill
+      std::vector<request *> waiters;
+      __u8 *buf = nullptr;
+      // a write overlapped the fill, its data must not be cached
+      bool stale = false;
+    };
+
+    struct frame {
+      __u64 page;
+      bool used = false;
+      bool referenced = false;
+    };
+
+    struct stream {
+      __u64 next = 0;   // where the next sequential read starts
+      __u64 ra_end = 0; // end of what was already read ahead
+      __u64 window = READAHEAD_MIN;
+    };
+
+    void read(request *req) {
+      const __u64 len = iov_length(req->iov);
+      if (len == 0) {
+        req->result = 0;
+        completed.push_back(req);
+        return;
+      }
+
+      const __u64 first = req->offset / CACHE_PAGE;
+      const __u64 last = (req->offset + len - 1) / CACHE_PAGE;
+
+      __u64 missing = 0;
+      for (__u64 page = first; page <= last; page++) {
+        missing += index.find(page) == index.end();
+      }
+      counters.hits += (last - first + 1) - missing;
+      counters.misses += missing;
+
+      if (missing == 0) {
+        copy_out(req, first, last);
+        req->result = len;
+        completed.push_back(req);
+      } else if (fill *f = pending_fill(req->offset, len)) {
+        // usually a reader catching up with its own readahead
+        f->waiters.push_back(req);
+      } else {
+        start_fill(first, last - first + 1, req);
+      }
+
+      readahead(req->offset, req->offset + len);
+    }
+
+    // copies the cached pages first..last into the request
+    void copy_out(request *req, __u64 first, __u64 last) {
+      const __u64 end = req->offset + iov_length(req->iov);
+      for (__u64 page = first; page <= last; page++) {
+        frame_ref(page);
+
+        const __u64 start = std::max(req->offset, page * CACHE_PAGE);
+        const __u64 stop = std::min(end, (page + 1) * CACHE_PAGE);
+        buf_to_iov(req->iov, start - req->offset, page_data(index[page]) + (start - page * CACHE_PAGE), stop - start);
+      }
+    }
+
+    fill *pending_fill(__u64 offset, __u64 len) {
+      for (auto &entry : fills) {
+        fill &f = *entry.second;
+        if (!f.stale && f.offset <= offset && offset + len <= f.offset + f.iov[0].iov_len) {
+          return &f;
+        }
+      }
+      return nullptr;
+    }
+
+    void start_fill(__u64 first, __u64 count, request *waiter) {
+      const __u64 offset = first * CACHE_PAGE;
+      const __u64 len = std::min(count * CACHE_PAGE, disk_size - offset);
+
+      auto f = std::make_unique<fill>();
+      f->type = op::read;
+      f->offset = offset;
+      if (waiter) {
+        f->waiters.push_back(waiter);
+      }
+      // aligned so the inner disk may be opened with O_DIRECT
+      f->buf = static_cast<__u8 *>(aligned_alloc(CACHE_PAGE, count * CACHE_PAGE));
+      f->iov.push_back({f->buf, len});
+      // the fill may see the disk before or after a write still in flight
+      f->stale = overlaps_write(offset, len);
+
+      fill *ptr = f.get();
+      fills.emplace(ptr, std::move(f));
+      inner->submit(ptr);
+    }
+
+    void finish_fill(fill &f, std::vector<request *> &done) {
+      const __u64 len = f.iov[0].iov_len;
+      const bool ok = f.result == __s64(len);
+
+      if (ok && !f.stale) {
+        memset(f.buf + len, 0, align(len) - len);
+        for (__u64 pos = 0; pos < len; pos += CACHE_PAGE) {
+          insert((f.offset + pos) / CACHE_PAGE, f.buf + pos);
+        }
+      }
+
+      for (request *req : f.waiters) {
+        const __u64 req_len = iov_length(req->iov);
+        if (ok) {
+          buf_to_iov(req->iov, 0, f.buf + (req->offset - f.offset), req_len);
+          req->result = req_len;
+        } else {
+          req->result = f.result < 0 ? f.result : -EIO;
+        }
+        done.push_back(req);
+      }
+    }
+
+    // follows up to STREAMS sequential readers and keeps the readahead
+    // window ahead of each of them
+    void readahead(__u64 offset, __u64 end) {
+      stream *s = nullptr;
+      for (auto &candidate : streams) {
+        if (candidate.next == offset) {
+          s = &candidate;
+          break;
+        }
+      }
+
+      if (s == nullptr) {
+        streams[stream_hand] = {end, end, READAHEAD_MIN};
+        stream_hand = (stream_hand + 1) % STREAMS;
+        return;
+      }
+
+      s->next = end;
+      if (s->ra_end > end + s->window / 2) {
+        return;
+      }
+
+      const __u64 start = align(std::max(s->ra_end, end));
+      if (start >= disk_size) {
+        return;
+      }
+      const __u64 len = std::min(s->window, disk_size - start);
+
+      // only fetch pages that are not already there
+      const __u64 first = start / CACHE_PAGE;
+      const __u64 count = (len + CACHE_PAGE - 1) / CACHE_PAGE;
+      if (index.find(first) == index.end()) {
+        start_fill(first, count, nullptr);
+        counters.readahead += count;
+      }
+
+      s->ra_end = start + len;
+      s->window = std::min(s->window * 2, READAHEAD_MAX);
+    }
+
+    void invalidate(__u64 offset, __u64 len) {
+      if (len == 0) {
+        return;
+      }
+
+      const __u64 first = offset / CACHE_PAGE;
+      const __u64 last = (offset + len - 1) / CACHE_PAGE;
+      for (__u64 page = first; page <= last; page++) {
+        auto it = index.find(page);
+        if (it != index.end()) {
+          frames[it->second].used = false;
+          index.erase(it);
+        }
+      }
+
+      for (auto &entry : fills) {
+        fill &f = *entry.second;
+        if (f.offset < offset + len && offset < f.offset + f.iov[0].iov_len) {
+          f.stale = true;
+        }
+      }
+    }
+
+    bool overlaps_write(__u64 offset, __u64 len) {
+      auto overlaps = [&](__u64 start, __u64 size) {
+        return start < offset + len && offset < start + size;
+      };
+
+      for (request *req : writes) {
+        if (req->type == op::write && overlaps(req->offset, iov_length(req->iov))) {
+          return true;
+        }
+        for (const auto &ext : req->extents) {
+          if (overlaps(ext.offset, ext.len)) {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    void insert(__u64 page, const __u8 *data) {
+      auto it = index.find(page);
+      if (it != index.end()) {
+        memcpy(page_data(it->second), data, CACHE_PAGE);
+        return;
+      }
+
+      const __u32 slot = evict();
+      frames[slot] = {page, true, false};
+      index[page] = slot;
+      memcpy(page_data(slot), data, CACHE_PAGE);
+    }
+
+    // CLOCK: the hand clears reference bits until it finds a frame that
+    // was not touched since its last pass
+    __u32 evict() {
+      while (frames[hand].used && frames[hand].referenced) {
+        frames[hand].referenced = false;
+        hand = (hand + 1) % frames.size();
+      }
+
+      const __u32 slot = hand;
+      if (frames[slot].used) {
+        index.erase(frames[slot].page);
+        counters.evictions++;
+      }
+      hand = (hand + 1) % frames.size();
+      return slot;
+    }
+
+    void frame_ref(__u64 page) {
+      frames[index[page]].referenced = true;
+    }
+
+    __u8 *page_data(__u32 slot) {
+      return memory.data() + __u64(slot) * CACHE_PAGE;
+    }
+
+    static __u64 align(__u64 offset) {
+      return (offset + CACHE_PAGE - 1) & ~(CACHE_PAGE - 1);
+    }
+
+    std::unique_ptr<disk> inner;
+    __u64 disk_size;
+
+    std::vector<frame> frames;
+    std::vector<__u8> memory;
+    std::unordered_map<__u64, __u32> index;
+    __u32 hand = 0;
+
+    std::array<stream, STREAMS> streams;
+    size_t stream_hand = 0;
+
+    std::unordered_map<request *, std::unique_ptr<fill>> fills;
+    std::unordered_set<request *> writes;
+    std::vector<request *> reaped;
+    std::vector<request *> completed;
+
+    cache_stats counters;
+  };
+
+} // namespace kvm::block
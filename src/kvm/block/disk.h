@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#include <asm/types.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace kvm::block {
+
+  enum class op {
+    read,
+    write,
+    flush,
+    discard,
+    write_zeroes,
+  };
+
+  // byte range of a discard or write_zeroes request
+  struct extent {
+    __u64 offset;
+    __u64 len;
+    // write_zeroes may leave a hole instead of allocated zeroes
+    bool unmap;
+  };
+
+  struct request {
+    op type;
+    __u64 offset; // bytes
+    std::vector<iovec> iov;
+    std::vector<extent> extents;
+
+    // write through, the data has to be stable once the request completes
+    bool fua = false;
+
+    // bytes transferred or -errno, set on completion
+    __s64 result;
+  };
+
+  // a host side disk image. submit() hands a request to the backend,
+  // reap() returns the ones that have completed since the last call.
+  class disk {
+  public:
+    virtual ~disk() {}
+
+    // size in bytes
+    virtual __u64 size() = 0;
+
+    virtual void submit(request *req) = 0;
+    virtual size_t reap(std::vector<request *> &done) = 0;
+
+    // pushes out requests submit() may have queued up
+    virtual void flush_submissions() {}
+
+    // readable while there are completions to reap, -1 if requests
+    // complete within submit()
+    virtual int event_fd() {
+      return -1;
+    }
+  };
+
+  // writes len zero bytes at offset, for when fallocate can not
+  inline __s64 pwrite_zeroes(int fd, __u64 offset, __u64 len) {
+    constexpr __u64 CHUNK = 1 << 20;
+    const std::vector<__u8> zeroes(std::min(len, CHUNK));
+    for (__u64 done = 0; done < len;) {
+      const __u64 chunk = std::min<__u64>(len - done, zeroes.size());
+      const ssize_t ret = pwrite(fd, zeroes.data(), chunk, offset + done);
+      if (ret < 0) {
+        return -errno;
+      }
+      if (ret == 0) {
+        return -EIO;
+      }
+      done += ret;
+    }
+    return 0;
+  }
+
+  // runs a discard or write_zeroes request against fd. discards are only
+  // hints and succeed even where the filesystem cannot punch holes.
+  // zeroing falls back to a hole where it cannot zero in place, and to
+  // writing zeroes where it can do neither.
+  inline __s64 fallocate_extents(int fd, const request &req) {
+    for (const auto &ext : req.extents) {
+      const bool hole = req.type == op::discard || ext.unmap;
+      int ret = fallocate(fd, FALLOC_FL_KEEP_SIZE | (hole ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE), ext.offset, ext.len);
+      if (ret < 0 && errno == EOPNOTSUPP && req.type == op::write_zeroes) {
+        ret = fallocate(fd, FALLOC_FL_KEEP_SIZE | (hole ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE), ext.offset, ext.len);
+      }
+
+      if (ret < 0) {
+        if (errno != EOPNOTSUPP) {
+          return -errno;
+        }
+        if (req.type == op::write_zeroes) {
+          const __s64 wret = pwrite_zeroes(fd, ext.offset, ext.len);
+          if (wret < 0) {
+            return wret;
+          }
+        }
+      }
+    }
+    return 0;
+  }
+
+  // base for backends that complete requests within submit()
+  class sync_disk : public disk {
+  public:
+    void submit(request *req) override {
+      execute(*req);
+      completed.push_back(req);
+    }
+
+    size_t reap(std::vector<request *> &done) override {
+      const size_t count = completed.size();
+      done.insert(done.end(), completed.begin(), completed.end());
+      completed.clear();
+      return count;
+    }
+
+  protected:
+    virtual void execute(request &req) = 0;
+
+  private:
+    std::vector<request *> completed;
+  };
+
+} // namespace kvm::block
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cerrno>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "kvm/util.h"
+
+#include "disk.h"
+
+namespace kvm::block {
+
+  class fstream_disk : public sync_disk {
+  public:
+    fstream_disk(const std::string &filename)
+        : file(filename, std::ios::binary | std::ios::in | std::ios::out)
+        , sync_fd(open(filename.c_str(), O_RDWR | O_CLOEXEC)) {
+      if (!file.is_open() || sync_fd < 0)
+        throw std::runtime_error(fmt::format("could not open file {}", filename));
+
+      file.seekg(0, std::ios::end);
+      file_size = file.tellg();
+    }
+
+    ~fstream_disk() {
+      close(sync_fd);
+    }
+
+    __u64 size() override {
+      return file_size;
+    }
+
+  protected:
+    void execute(request &req) override {
+      req.result = 0;
+
+      switch (req.type) {
+      case op::read:
+        file.seekg(req.offset);
+        for (const auto &seg : req.iov) {
+          file.read(reinterpret_cast<char *>(seg.iov_base), seg.iov_len);
+          req.result += seg.iov_len;
+        }
+        break;
+
+      case op::write:
+        file.seekp(req.offset);
+        for (const auto &seg : req.iov) {
+          file.write(reinterpret_cast<char *>(seg.iov_base), seg.iov_len);
+          req.result += seg.iov_len;
+        }
+        if (req.fua && !sync()) {
+          req.result = -EIO;
+        }
+        break;
+
+      case op::flush:
+        req.result = sync() ? 0 : -EIO;
+        break;
+
+      case op::discard:
+      case op::write_zeroes:
+        // buffered writes must not land on top of the new hole
+        file.flush();
+        req.result = fallocate_extents(sync_fd, req);
+        break;
+      }
+
+      if (!file) {
+        file.clear();
+        req.result = -EIO;
+      }
+    }
+
+    // the stream has no fd of its own, any fd on the file will do for
+    // fdatasync and fallocate once the buffer has been pushed out
+    bool sync() {
+      file.flush();
+      return file && fdatasync(sync_fd) == 0;
+    }
+
+  private:
+    std::fstream file;
+    int sync_fd;
+    __u64 file_size;
+  };
+
+} // namespace kvm::block
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <asm/types.h>
+
+#include "disk.h"
+
+namespace kvm::block {
+
+  // binary log of every request a disk served, for replaying real
+  // workloads against other backends. the file is an 8 byte magic
+  // followed by fixed size records in host byte order, in completion
+  // order.
+  class io_trace {
+  public:
+    static constexpr char MAGIC[8] = {'K', 'T', 'H', 'X', 'T', 'R', 'C', '1'};
+
+    struct record {
+      __u64 time;    // ns from the start of the trace to taking the request
+      __u64 latency; // ns until the request was completed to the guest
+      __u64 sector;
+      __u32 len;     // bytes
+      __u8 type;     // op
+      __u8 queue;
+      __u16 reserved;
+    };
+    static_assert(sizeof(record) == 32);
+
+    using clock = std::chrono::steady_clock;
+
+    class writer {
+    public:
+      explicit writer(const std::string &filename)
+          : file(filename, std::ios::out | std::ios::trunc | std::ios::binary)
+          , start(clock::now()) {
+        if (!file.is_open())
+          throw std::runtime_error(fmt::format("could not open file {}", filename));
+        file.write(MAGIC, sizeof(MAGIC));
+      }
+
+      // ns since the trace started
+      __u64 since_start(clock::time_point t) const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t - start).count();
+      }
+
+      // queues hand over their records a batch at a time
+      void append(const std::vector<record> &records) {
+        if (records.empty()) {
+          return;
+        }
+
+        const std::lock_guard<std::mutex> lock(mu);
+        file.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(record));
+      }
+
+    private:
+      std::mutex mu;
+      std::ofstream file;
+      clock::time_point start;
+    };
+
+    // records sorted by the time they were taken, the file holds them
+    // in completion order
+    static std::vector<record> load(const std::string &filename) {
+      std::ifstream file(filename, std::ios::in | std::ios::binary);
+      if (!file.is_open())
+        throw std::runtime_error(fmt::format("could not open file {}", filename));
+
+      char magic[sizeof(MAGIC)];
+      if (!file.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw std::runtime_error(fmt::format("{} is not an io trace", filename));
+
+      std::vector<record> records;
+      record rec;
+      while (file.read(reinterpret_cast<char *>(&rec), sizeof(rec))) {
+        if (rec.type > __u8(op::write_zeroes))
+          throw std::runtime_error(fmt::format("{} has a record of unknown type {}", filename, rec.type));
+        records.push_back(rec);
+      }
+
+      std::stable_sort(records.begin(), records.end(), [](const record &a, const record &b) {
+        return a.time < b.time;
+      });
+      return records;
+    }
+  };
+
+} // namespace kvm::block
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kvm/memory.h"
+#include "kvm/util.h"
+
+#include "disk.h"
+
+namespace kvm::block {
+
+  // maps the whole image and copies between the mapping and guest memory,
+  // no syscall per request. the mapping is shared, so every queue and
+  // every vm mapping the same image shares its page cache.
+  //
+  // an io error or a truncated image shows up as SIGBUS rather than an
+  // error status, only use this for images on reliable storage.
+  class mmap_disk : public sync_disk {
+  public:
+    mmap_disk(const std::string &filename, bool readonly)
+        : fd(open(filename.c_str(), (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC)) {
+      if (fd < 0)
+        throw std::runtime_error(fmt::format("could not open file {}", filename));
+
+      struct stat st;
+      if (fstat(fd, &st) < 0)
+        throw std::runtime_error(errno_msg("fstat"));
+      file_size = st.st_size;
+
+      if (file_size) {
+        void *ptr = mmap(nullptr, file_size, PROT_READ | (readonly ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED)
+          throw std::runtime_error(errno_msg("mmap"));
+        image = static_cast<__u8 *>(ptr);
+      }
+    }
+
+    ~mmap_disk() {
+      if (image) {
+        munmap(image, file_size);
+      }
+      close(fd);
+    }
+
+    __u64 size() override {
+      return file_size;
+    }
+
+  protected:
+    void execute(request &req) override {
+      const __u64 len = iov_length(req.iov);
+      if ((req.type == op::read || req.type == op::write) &&
+          (req.offset > file_size || len > file_size - req.offset)) {
+        req.result = -EIO;
+        return;
+      }
+
+      switch (req.type) {
+      case op::read:
+        req.result = buf_to_iov(req.iov, 0, image + req.offset, len);
+        break;
+
+      case op::write:
+        req.result = iov_to_buf(req.iov, 0, image + req.offset, len);
+        if (req.fua && !sync(req.offset, len)) {
+          req.result = -errno;
+        }
+        break;
+
+      case op::flush:
+        req.result = sync(0, file_size) ? 0 : -errno;
+        break;
+
+      case op::discard:
+      case op::write_zeroes:
+        // the mapping sees the holes through the page cache
+        req.result = fallocate_extents(fd, req);
+        break;
+      }
+    }
+
+  private:
+    // msync wants a page aligned start
+    bool sync(__u64 offset, __u64 len) {
+      if (len == 0) {
+        return true;
+      }
+
+      const __u64 page = sysconf(_SC_PAGESIZE);
+      const __u64 start = offset & ~(page - 1);
+      return msync(image + start, len + (offset - start), MS_SYNC) == 0;
+    }
+
+    int fd;
+    __u64 file_size;
+    __u8 *image = nullptr;
+  };
+
+} // namespace kvm::block
@@ -0,0 +1,828 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kvm/memory.h"
+#include "kvm/util.h"
+
+#include "disk.h"
+
+namespace kvm::block {
+
+  // client for a disk exported over the network block device protocol.
+  // the address is "unix:<path>" or "<host>[:<port>]".
+  //
+  // every request goes out as soon as it is submitted and replies are
+  // matched by handle, so any number of them are in flight per
+  // connection. with structured replies reads may come back in chunks
+  // and as holes. requests are spread over the connections, more than
+  // one is only used when the server allows it for the export. fua and
+  // write zeroes fall back to a flush behind the write and to plain
+  // writes of zeroes where the server lacks them.
+  class nbd_disk : public disk {
+  public:
+    static constexpr const char *DEFAULT_PORT = "10809";
+    static constexpr size_t RECV_BUFFER = 256 << 10;
+
+    nbd_disk(const std::string &address, const std::string &export_name, __u32 connections, bool readonly)
+        : epoll(epoll_create1(EPOLL_CLOEXEC)) {
+      if (epoll < 0)
+        throw std::runtime_error(errno_msg("epoll_create1"));
+
+      open_connection(address, export_name);
+      if (connections > 1 && !(transmission_flags & FLAG_CAN_MULTI_CONN)) {
+        fmt::print("kvm::block::nbd_disk {} does not allow multiple connections, using one\n", address);
+        connections = 1;
+      }
+      for (__u32 i = 1; i < connections; i++) {
+        open_connection(address, export_name);
+      }
+
+      if ((transmission_flags & FLAG_READ_ONLY) && !readonly)
+        throw std::runtime_error(fmt::format("nbd export {} is read-only", export_name));
+    }
+
+    ~nbd_disk() {
+      for (auto &c : conns) {
+        if (c->alive) {
+          // best effort, the server drops the connection either way
+          __u8 header[REQUEST_SIZE];
+          encode_request(header, {nullptr, CMD_DISC, 0, 0, 0, 0}, 0);
+          send(c->fd, header, sizeof(header), MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        close(c->fd);
+      }
+      close(epoll);
+    }
+
+    __u64 size() override {
+      return export_size;
+    }
+
+    // the server keeps writes and flushes consistent across connections
+    bool multi_conn() const {
+      return transmission_flags & FLAG_CAN_MULTI_CONN;
+    }
+
+    void submit(request *req) override {
+      switch (req->type) {
+      case op::read:
+        queue(req, {req, CMD_READ, 0, req->offset, __u32(iov_length(req->iov)), 0});
+        break;
+
+      case op::write: {
+        const bool fua = req->fua && (transmission_flags & FLAG_SEND_FUA);
+        queue(req, {req, CMD_WRITE, __u16(fua ? CMD_FLAG_FUA : 0), req->offset, __u32(iov_length(req->iov)), 0});
+        // a flush only covers writes completed before it is sent, so
+        // it goes out once the write is done
+        if (req->fua && !fua && (transmission_flags & FLAG_SEND_FLUSH)) {
+          progress[req].flush_after = true;
+        }
+        break;
+      }
+
+      case op::flush:
+        // without a write cache on the server there is nothing to flush
+        if (transmission_flags & FLAG_SEND_FLUSH) {
+          queue(req, {req, CMD_FLUSH, 0, 0, 0, 0});
+        }
+        break;
+
+      case op::discard:
+        // only a hint, fine to drop when the server cannot trim
+        if (transmission_flags & FLAG_SEND_TRIM) {
+          for (const auto &ext : req->extents) {
+            queue(req, {req, CMD_TRIM, 0, ext.offset, __u32(ext.len), 0});
+          }
+        }
+        break;
+
+      case op::write_zeroes:
+        for (const auto &ext : req->extents) {
+          if (transmission_flags & FLAG_SEND_WRITE_ZEROES) {
+            queue(req, {req, CMD_WRITE_ZEROES, __u16(ext.unmap ? 0 : CMD_FLAG_NO_HOLE), ext.offset, __u32(ext.len), 0});
+            continue;
+          }
+          // plain writes of zeroes where the server cannot zero
+          for (__u64 pos = 0; pos < ext.len; pos += ZERO_WRITE_MAX) {
+            queue(req, {req, CMD_WRITE, 0, ext.offset + pos, __u32(std::min<__u64>(ext.len - pos, ZERO_WRITE_MAX)), 0});
+          }
+        }
+        break;
+      }
+
+      // nothing went out, or no connection was left to send it on
+      auto it = progress.find(req);
+      if (it == progress.end()) {
+        req->result = 0;
+        completed.push_back(req);
+      } else if (it->second.parts == 0) {
+        req->result = -__s64(it->second.error);
+        progress.erase(it);
+        completed.push_back(req);
+      }
+    }
+
+    void flush_submissions() override {
+      for (auto &c : conns) {
+        if (c->alive && !c->sendq.empty()) {
+          send_some(*c, completed);
+        }
+      }
+    }
+
+    size_t reap(std::vector<request *> &done) override {
+      const size_t before = done.size();
+
+      for (auto &c : conns) {
+        if (c->alive) {
+          recv_some(*c, done);
+        }
+      }
+      // after the replies, they may have queued flushes behind writes
+      for (auto &c : conns) {
+        if (c->alive && !c->sendq.empty()) {
+          send_some(*c, done);
+        }
+      }
+
+      done.insert(done.end(), completed.begin(), completed.end());
+      completed.clear();
+      return done.size() - before;
+    }
+
+    // readable while any connection has replies waiting, or room for
+    // requests that did not fit into the socket buffer before
+    int event_fd() override {
+      return epoll;
+    }
+
+  private:
+    static constexpr __u64 NBDMAGIC = 0x4e42444d41474943;
+    static constexpr __u64 IHAVEOPT = 0x49484156454f5054;
+    static constexpr __u64 OPTION_REPLY_MAGIC = 0x3e889045565a9;
+    static constexpr __u32 REQUEST_MAGIC = 0x25609513;
+    static constexpr __u32 SIMPLE_REPLY_MAGIC = 0x67446698;
+    static constexpr __u32 STRUCTURED_REPLY_MAGIC = 0x668e33ef;
+
+    static constexpr __u16 FLAG_FIXED_NEWSTYLE = 1 << 0;
+    static constexpr __u16 FLAG_NO_ZEROES = 1 << 1;
+
+    static constexpr __u32 OPT_GO = 7;
+    static constexpr __u32 OPT_STRUCTURED_REPLY = 8;
+    static constexpr __u32 REP_ACK = 1;
+    static constexpr __u32 REP_INFO = 3;
+    static constexpr __u32 REP_FLAG_ERROR = 1u << 31;
+    static constexpr __u16 INFO_EXPORT = 0;
+
+    static constexpr __u16 FLAG_READ_ONLY = 1 << 1;
+    static constexpr __u16 FLAG_SEND_FLUSH = 1 << 2;
+    static constexpr __u16 FLAG_SEND_FUA = 1 << 3;
+    static constexpr __u16 FLAG_SEND_TRIM = 1 << 5;
+    static constexpr __u16 FLAG_SEND_WRITE_ZEROES = 1 << 6;
+    static constexpr __u16 FLAG_CAN_MULTI_CONN = 1 << 8;
+
+    static constexpr __u16 CMD_READ = 0;
+    static constexpr __u16 CMD_WRITE = 1;
+    static constexpr __u16 CMD_DISC = 2;
+    static constexpr __u16 CMD_FLUSH = 3;
+    static constexpr __u16 CMD_TRIM = 4;
+    static constexpr __u16 CMD_WRITE_ZEROES = 6;
+    static constexpr __u16 CMD_FLAG_FUA = 1 << 0;
+    static constexpr __u16 CMD_FLAG_NO_HOLE = 1 << 1;
+
+    static constexpr __u16 REPLY_FLAG_DONE = 1 << 0;
+    static constexpr __u16 REPLY_TYPE_NONE = 0;
+    static constexpr __u16 REPLY_TYPE_OFFSET_DATA = 1;
+    static constexpr __u16 REPLY_TYPE_OFFSET_HOLE = 2;
+    static constexpr __u16 REPLY_TYPE_ERROR = 1 << 15;
+
+    static constexpr size_t REQUEST_SIZE = 28;
+    static constexpr size_t SIMPLE_REPLY_SIZE = 16;
+    static constexpr size_t STRUCTURED_REPLY_SIZE = 20;
+
+    // largest write a write zeroes request without server support is
+    // split into
+    static constexpr __u64 ZERO_WRITE_MAX = 1 << 20;
+
+    // one nbd command, a discard or write zeroes request with several
+    // extents sends one per extent
+    struct command {
+      request *req;
+      __u16 type;
+      __u16 flags;
+      __u64 offset;
+      __u32 len;
+      __u32 error;
+    };
+
+    // commands of a request still outstanding, and the first error
+    struct outstanding {
+      __u32 parts = 0;
+      __u32 error = 0;
+      // fua without server support, a flush follows the write
+      bool flush_after = false;
+    };
+
+    enum class stage {
+      header,
+      data_offset, // start of an offset data chunk
+      data,        // read data going into the request
+      payload,     // a small chunk that is parsed whole
+      skip,
+    };
+
+    struct connection {
+      int fd;
+      bool alive = true;
+      bool want_write = false;
+
+      std::unordered_map<__u64, command> inflight;
+      // handles still to send, the front one may be partly sent
+      std::deque<__u64> sendq;
+      size_t sent = 0;
+
+      std::vector<__u8> rx = std::vector<__u8>(RECV_BUFFER);
+      size_t rx_start = 0;
+      size_t rx_end = 0;
+
+      // the reply being received
+      stage state = stage::header;
+      __u64 handle;
+      command *cmd;
+      bool last;       // completes the command once received
+      __u16 type;      // structured chunk type
+      __u32 remaining; // bytes left of the data, payload or skip
+      __u64 data_pos;  // where in the request the data goes
+    };
+
+    // blocking connect and handshake, the socket is switched to
+    // non-blocking for the transmission phase
+    void open_connection(const std::string &address, const std::string &export_name) {
+      auto c = std::make_unique<connection>();
+      c->fd = connect_socket(address);
+      try {
+        handshake(c->fd, export_name);
+      } catch (...) {
+        close(c->fd);
+        throw;
+      }
+
+      if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0)
+        throw std::runtime_error(errno_msg("fcntl"));
+
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.ptr = c.get();
+      if (epoll_ctl(epoll, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        throw std::runtime_error(errno_msg("epoll_ctl"));
+
+      conns.push_back(std::move(c));
+    }
+
+    static int connect_socket(const std::string &address) {
+      if (address.rfind("unix:", 0) == 0) {
+        const std::string path = address.substr(5);
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+          throw std::runtime_error(fmt::format("nbd socket path {} is too long", path));
+        memcpy(addr.sun_path, path.c_str(), path.size());
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+          throw std::runtime_error(errno_msg("socket"));
+        if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+          const std::string msg = errno_msg(fmt::format("connect {}", address));
+          close(fd);
+          throw std::runtime_error(msg);
+        }
+        return fd;
+      }
+
+      // host, host:port or [v6 host]:port
+      std::string host = address;
+      std::string port = DEFAULT_PORT;
+      const size_t colon = address.rfind(':');
+      if (colon != std::string::npos && address.find(':') == colon) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+      } else if (address[0] == '[' && colon != std::string::npos && address[colon - 1] == ']') {
+        host = address.substr(1, colon - 2);
+        port = address.substr(colon + 1);
+      }
+
+      struct addrinfo hints = {};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      struct addrinfo *res;
+      const int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+      if (err != 0)
+        throw std::runtime_error(fmt::format("could not resolve {}: {}", address, gai_strerror(err)));
+
+      int fd = -1;
+      for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+          close(fd);
+          fd = -1;
+        }
+      }
+      freeaddrinfo(res);
+      if (fd < 0)
+        throw std::runtime_error(errno_msg(fmt::format("connect {}", address)));
+
+      // small requests must not wait for more to coalesce with
+      const int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      return fd;
+    }
+
+    // fixed newstyle negotiation, structured replies if the server has
+    // them and NBD_OPT_GO for the export
+    void handshake(int fd, const std::string &export_name) {
+      __u8 hello[18];
+      recv_all(fd, hello, sizeof(hello));
+      if (get64(hello) != NBDMAGIC || get64(hello + 8) != IHAVEOPT)
+        throw std::runtime_error("not an nbd server, or one without newstyle negotiation");
+
+      const __u16 server_flags = get16(hello + 16);
+      if (!(server_flags & FLAG_FIXED_NEWSTYLE))
+        throw std::runtime_error("nbd server does not support fixed newstyle negotiation");
+
+      __u8 client_flags[4];
+      put32(client_flags, FLAG_FIXED_NEWSTYLE | (server_flags & FLAG_NO_ZEROES));
+      send_all(fd, client_flags, sizeof(client_flags));
+
+      // replies are parsed either way, an error here just means the
+      // server sticks to simple ones
+      std::vector<__u8> data;
+      send_option(fd, OPT_STRUCTURED_REPLY, {});
+      recv_option_reply(fd, OPT_STRUCTURED_REPLY, data);
+
+      std::vector<__u8> go(4 + export_name.size() + 2);
+      put32(go.data(), export_name.size());
+      memcpy(go.data() + 4, export_name.data(), export_name.size());
+      put16(go.data() + 4 + export_name.size(), 0);
+      send_option(fd, OPT_GO, go);
+
+      bool have_export = false;
+      for (;;) {
+        const __u32 reply = recv_option_reply(fd, OPT_GO, data);
+        if (reply == REP_ACK) {
+          break;
+        }
+        if (reply & REP_FLAG_ERROR) {
+          throw std::runtime_error(fmt::format("nbd server refused export {}: {} {}", export_name, reply & ~REP_FLAG_ERROR,
+                                               std::string(data.begin(), data.end())));
+        }
+        if (reply == REP_INFO && data.size() >= 12 && get16(data.data()) == INFO_EXPORT) {
+          export_size = get64(data.data() + 2);
+          transmission_flags = get16(data.data() + 10);
+          have_export = true;
+        }
+      }
+
+      if (!have_export)
+        throw std::runtime_error(fmt::format("nbd server sent no size for export {}", export_name));
+    }
+
+    static void send_option(int fd, __u32 option, const std::vector<__u8> &data) {
+      std::vector<__u8> buf(16 + data.size());
+      put64(buf.data(), IHAVEOPT);
+      put32(buf.data() + 8, option);
+      put32(buf.data() + 12, data.size());
+      std::copy(data.begin(), data.end(), buf.begin() + 16);
+      send_all(fd, buf.data(), buf.size());
+    }
+
+    static __u32 recv_option_reply(int fd, __u32 option, std::vector<__u8> &data) {
+      __u8 header[20];
+      recv_all(fd, header, sizeof(header));
+      if (get64(header) != OPTION_REPLY_MAGIC || get32(header + 8) != option)
+        throw std::runtime_error("malformed nbd option reply");
+
+      data.resize(get32(header + 16));
+      recv_all(fd, data.data(), data.size());
+      return get32(header + 12);
+    }
+
+    static void send_all(int fd, const void *buf, size_t len) {
+      const __u8 *pos = static_cast<const __u8 *>(buf);
+      while (len) {
+        const ssize_t n = send(fd, pos, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0)
+          throw std::runtime_error(errno_msg("nbd send"));
+        pos += n;
+        len -= n;
+      }
+    }
+
+    static void recv_all(int fd, void *buf, size_t len) {
+      __u8 *pos = static_cast<__u8 *>(buf);
+      while (len) {
+        const ssize_t n = recv(fd, pos, len, 0);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n == 0)
+          throw std::runtime_error("nbd server closed the connection");
+        if (n < 0)
+          throw std::runtime_error(errno_msg("nbd recv"));
+        pos += n;
+        len -= n;
+      }
+    }
+
+    // hands the command to the least busy connection
+    void queue(request *req, const command &cmd) {
+      connection *c = nullptr;
+      for (auto &candidate : conns) {
+        if (candidate->alive && (c == nullptr || candidate->inflight.size() < c->inflight.size())) {
+          c = candidate.get();
+        }
+      }
+
+      outstanding &p = progress[req];
+      if (c == nullptr) {
+        p.error = EIO;
+        return;
+      }
+
+      const __u64 handle = next_handle++;
+      c->inflight.emplace(handle, cmd);
+      c->sendq.push_back(handle);
+      p.parts++;
+    }
+
+    static void encode_request(__u8 *header, const command &cmd, __u64 handle) {
+      put32(header, REQUEST_MAGIC);
+      put16(header + 4, cmd.flags);
+      put16(header + 6, cmd.type);
+      put64(header + 8, handle);
+      put64(header + 16, cmd.offset);
+      put32(header + 24, cmd.len);
+    }
+
+    // writes as much of the send queue as the socket takes, a write
+    // command is its header followed by the request data, or zeroes
+    // for a write zeroes request
+    void send_some(connection &c, std::vector<request *> &done) {
+      static const __u8 zeroes[64 << 10] = {};
+      std::vector<iovec> iov;
+      __u8 header[REQUEST_SIZE];
+
+      while (!c.sendq.empty()) {
+        const __u64 handle = c.sendq.front();
+        const command &cmd = c.inflight.at(handle);
+        encode_request(header, cmd, handle);
+
+        const size_t data_len = cmd.type == CMD_WRITE ? cmd.len : 0;
+        iov.clear();
+        if (c.sent < REQUEST_SIZE) {
+          iov.push_back({header + c.sent, REQUEST_SIZE - c.sent});
+        }
+        if (data_len) {
+          const size_t data_sent = c.sent > REQUEST_SIZE ? c.sent - REQUEST_SIZE : 0;
+          if (cmd.req->type == op::write_zeroes) {
+            for (size_t pos = data_sent; pos < data_len && iov.size() < 32; pos += sizeof(zeroes)) {
+              iov.push_back({const_cast<__u8 *>(zeroes), std::min(sizeof(zeroes), data_len - pos)});
+            }
+          } else {
+            iov_slice(cmd.req->iov, data_sent, data_len - data_sent, iov);
+          }
+        }
+
+        struct msghdr msg = {};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+        const ssize_t n = sendmsg(c.fd, &msg, MSG_NOSIGNAL | (c.sendq.size() > 1 ? MSG_MORE : 0));
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+        }
+        if (n < 0) {
+          fail(c, errno_msg("nbd send"), done);
+          return;
+        }
+
+        c.sent += n;
+        if (c.sent == REQUEST_SIZE + data_len) {
+          c.sendq.pop_front();
+          c.sent = 0;
+        }
+      }
+
+      watch_writable(c, !c.sendq.empty());
+    }
+
+    void watch_writable(connection &c, bool writable) {
+      if (c.want_write == writable) {
+        return;
+      }
+
+      struct epoll_event ev = {};
+      ev.events = __u32(EPOLLIN) | (writable ? __u32(EPOLLOUT) : 0u);
+      ev.data.ptr = &c;
+      epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &ev);
+      c.want_write = writable;
+    }
+
+    void recv_some(connection &c, std::vector<request *> &done) {
+      while (c.alive) {
+        if (c.rx_start == c.rx_end) {
+          c.rx_start = c.rx_end = 0;
+        } else if (c.rx_end == c.rx.size()) {
+          memmove(c.rx.data(), c.rx.data() + c.rx_start, c.rx_end - c.rx_start);
+          c.rx_end -= c.rx_start;
+          c.rx_start = 0;
+        }
+
+        const ssize_t n = recv(c.fd, c.rx.data() + c.rx_end, c.rx.size() - c.rx_end, 0);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          return;
+        }
+        if (n <= 0) {
+          fail(c, n == 0 ? "nbd server closed the connection" : errno_msg("nbd recv"), done);
+          return;
+        }
+
+        c.rx_end += n;
+        parse(c, done);
+      }
+    }
+
+    // consumes whatever replies, or parts of them, are in the buffer
+    void parse(connection &c, std::vector<request *> &done) {
+      while (c.alive) {
+        const __u8 *buf = c.rx.data() + c.rx_start;
+        const size_t avail = c.rx_end - c.rx_start;
+
+        switch (c.state) {
+        case stage::header: {
+          if (avail < 4) {
+            return;
+          }
+          const __u32 magic = get32(buf);
+          const size_t size = magic == SIMPLE_REPLY_MAGIC ? SIMPLE_REPLY_SIZE : STRUCTURED_REPLY_SIZE;
+          if (magic != SIMPLE_REPLY_MAGIC && magic != STRUCTURED_REPLY_MAGIC) {
+            fail(c, fmt::format("bad nbd reply magic {:x}", magic), done);
+            return;
+          }
+          if (avail < size) {
+            return;
+          }
+
+          c.handle = get64(buf + 8);
+          auto it = c.inflight.find(c.handle);
+          if (it == c.inflight.end()) {
+            fail(c, fmt::format("nbd reply for unknown handle {}", c.handle), done);
+            return;
+          }
+          c.cmd = &it->second;
+          c.rx_start += size;
+
+          if (magic == SIMPLE_REPLY_MAGIC) {
+            c.last = true;
+            c.cmd->error = get32(buf + 4);
+            if (c.cmd->error == 0 && c.cmd->type == CMD_READ && c.cmd->len) {
+              c.state = stage::data;
+              c.remaining = c.cmd->len;
+              c.data_pos = c.cmd->offset - c.cmd->req->offset;
+            } else {
+              chunk_done(c, done);
+            }
+            break;
+          }
+
+          c.last = get16(buf + 4) & REPLY_FLAG_DONE;
+          c.type = get16(buf + 6);
+          c.remaining = get32(buf + 16);
+          if (c.type == REPLY_TYPE_NONE && c.remaining == 0) {
+            chunk_done(c, done);
+          } else if (c.type == REPLY_TYPE_OFFSET_DATA && c.cmd->type == CMD_READ && c.remaining >= 8) {
+            c.state = stage::data_offset;
+          } else if (c.type == REPLY_TYPE_OFFSET_HOLE || (c.type & REPLY_TYPE_ERROR)) {
+            if (c.remaining > c.rx.size()) {
+              fail(c, fmt::format("nbd reply chunk of {} bytes", c.remaining), done);
+              return;
+            }
+            c.state = stage::payload;
+          } else {
+            c.state = stage::skip;
+          }
+          break;
+        }
+
+        case stage::data_offset: {
+          if (avail < 8) {
+            return;
+          }
+          const __u64 offset = get64(buf);
+          c.rx_start += 8;
+          c.remaining -= 8;
+          if (offset < c.cmd->offset || offset + c.remaining > c.cmd->offset + c.cmd->len) {
+            fail(c, "nbd read data outside of the request", done);
+            return;
+          }
+          c.data_pos = offset - c.cmd->req->offset;
+          if (c.remaining) {
+            c.state = stage::data;
+          } else {
+            chunk_done(c, done);
+          }
+          break;
+        }
+
+        case stage::data: {
+          if (avail == 0) {
+            return;
+          }
+          const size_t len = std::min<size_t>(avail, c.remaining);
+          buf_to_iov(c.cmd->req->iov, c.data_pos, buf, len);
+          c.rx_start += len;
+          c.data_pos += len;
+          c.remaining -= len;
+          if (c.remaining == 0) {
+            chunk_done(c, done);
+          }
+          break;
+        }
+
+        case stage::payload:
+          if (avail < c.remaining) {
+            return;
+          }
+          if (c.type == REPLY_TYPE_OFFSET_HOLE) {
+            zero_hole(c, buf);
+          } else {
+            c.cmd->error = c.remaining >= 4 ? get32(buf) : EIO;
+            if (c.cmd->error == 0) {
+              c.cmd->error = EIO;
+            }
+          }
+          c.rx_start += c.remaining;
+          chunk_done(c, done);
+          break;
+
+        case stage::skip: {
+          const size_t len = std::min<size_t>(avail, c.remaining);
+          c.rx_start += len;
+          c.remaining -= len;
+          if (c.remaining) {
+            return;
+          }
+          chunk_done(c, done);
+          break;
+        }
+        }
+      }
+    }
+
+    void zero_hole(connection &c, const __u8 *payload) {
+      static const __u8 zeroes[4096] = {};
+
+      if (c.remaining < 12) {
+        c.cmd->error = EIO;
+        return;
+      }
+      const __u64 offset = get64(payload);
+      const __u32 len = get32(payload + 8);
+      if (offset < c.cmd->offset || offset + len > c.cmd->offset + c.cmd->len) {
+        c.cmd->error = EIO;
+        return;
+      }
+
+      const __u64 start = offset - c.cmd->req->offset;
+      for (__u64 pos = 0; pos < len; pos += sizeof(zeroes)) {
+        buf_to_iov(c.cmd->req->iov, start + pos, zeroes, std::min<__u64>(sizeof(zeroes), len - pos));
+      }
+    }
+
+    void chunk_done(connection &c, std::vector<request *> &done) {
+      c.state = stage::header;
+      if (!c.last) {
+        return;
+      }
+
+      const command cmd = *c.cmd;
+      c.inflight.erase(c.handle);
+      complete(cmd, done);
+    }
+
+    void complete(const command &cmd, std::vector<request *> &done) {
+      auto it = progress.find(cmd.req);
+      outstanding &p = it->second;
+      if (cmd.error && !p.error) {
+        p.error = cmd.error;
+      }
+      if (--p.parts) {
+        return;
+      }
+
+      request *req = cmd.req;
+      if (p.flush_after && !p.error) {
+        p.flush_after = false;
+        queue(req, {req, CMD_FLUSH, 0, 0, 0, 0});
+        if (p.parts) {
+          return;
+        }
+      }
+      if (p.error) {
+        req->result = -__s64(p.error);
+      } else {
+        req->result = req->type == op::read || req->type == op::write ? iov_length(req->iov) : 0;
+      }
+      progress.erase(it);
+      done.push_back(req);
+    }
+
+    // a broken connection fails everything in flight on it, the other
+    // connections carry on
+    void fail(connection &c, const std::string &reason, std::vector<request *> &done) {
+      fmt::print("kvm::block::nbd_disk connection lost: {}\n", reason);
+      c.alive = false;
+      epoll_ctl(epoll, EPOLL_CTL_DEL, c.fd, nullptr);
+
+      for (auto &entry : c.inflight) {
+        command cmd = entry.second;
+        cmd.error = EIO;
+        complete(cmd, done);
+      }
+      c.inflight.clear();
+      c.sendq.clear();
+    }
+
+    static __u16 get16(const __u8 *p) {
+      __u16 v;
+      memcpy(&v, p, sizeof(v));
+      return be16toh(v);
+    }
+
+    static __u32 get32(const __u8 *p) {
+      __u32 v;
+      memcpy(&v, p, sizeof(v));
+      return be32toh(v);
+    }
+
+    static __u64 get64(const __u8 *p) {
+      __u64 v;
+      memcpy(&v, p, sizeof(v));
+      return be64toh(v);
+    }
+
+    static void put16(__u8 *p, __u16 v) {
+      v = htobe16(v);
+      memcpy(p, &v, sizeof(v));
+    }
+
+    static void put32(__u8 *p, __u32 v) {
+      v = htobe32(v);
+      memcpy(p, &v, sizeof(v));
+    }
+
+    static void put64(__u8 *p, __u64 v) {
+      v = htobe64(v);
+      memcpy(p, &v, sizeof(v));
+    }
+
+    int epoll;
+    std::vector<std::unique_ptr<connection>> conns;
+
+    __u64 export_size = 0;
+    __u16 transmission_flags = 0;
+
+    __u64 next_handle = 1;
+    std::unordered_map<request *, outstanding> progress;
+    std::vector<request *> completed;
+  };
+
+} // namespace kvm::block
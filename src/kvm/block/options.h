@@ -0,0 +1,197 @@
+#pragma once
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <asm/types.h>
+
+namespace kvm::block {
+
+  enum class backend_type {
+    fstream,
+    uring,
+    // copy-on-write overlay over a read-only base image
+    overlay,
+    // copies to and from a shared mapping of the image
+    mmap,
+    // network block device client, path is "unix:<socket>" or "host[:port]"
+    nbd,
+  };
+
+  enum class cache_mode {
+    // writes complete once the host has them, the guest flushes
+    writeback,
+    // every write is stable on completion
+    writethrough,
+  };
+
+  // per disk settings, given as "path[,key=value...]"
+  struct options {
+    std::string path;
+    backend_type backend = backend_type::uring;
+    cache_mode cache = cache_mode::writeback;
+
+    // base image an overlay is created on if path does not exist yet
+    std::string base;
+    // nbd export name and connections per queue
+    std::string export_name;
+    __u32 connections = 1;
+
+    // bypass the host page cache
+    bool direct = false;
+    // the guest may not write, the image is opened read-only
+    bool readonly = false;
+    // bytes of userspace block cache, 0 disables it
+    __u64 cache_size = 0;
+
+    // logs the reads of the first trace_seconds to this file
+    std::string trace_record;
+    __u32 trace_seconds = 60;
+    // prefetches the reads of an earlier trace at start
+    std::string prefetch;
+    // logs every request in the binary io_trace format, for bench/replay
+    std::string io_trace;
+
+    // rate limits, 0 is unlimited. bursts default to one second worth.
+    __u64 iops = 0;
+    __u64 iops_burst = 0;
+    __u64 bps = 0;
+    __u64 bps_burst = 0;
+
+    // virtqueues, each served by its own worker and disk instance
+    __u32 queues = 1;
+    // pin queue n's worker to host cpu pin + n, -1 leaves them floating
+    int pin = -1;
+
+    // rewrites per queue counters and latency histograms to this file
+    // every second
+    std::string stats;
+
+    static options parse(const std::string &spec) {
+      options opts;
+
+      std::stringstream stream(spec);
+      std::getline(stream, opts.path, ',');
+
+      std::string item;
+      while (std::getline(stream, item, ',')) {
+        const size_t eq = item.find('=');
+        const std::string key = item.substr(0, eq);
+        const std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+
+        if (key == "backend") {
+          if (value == "fstream")
+            opts.backend = backend_type::fstream;
+          else if (value == "uring")
+            opts.backend = backend_type::uring;
+          else if (value == "overlay")
+            opts.backend = backend_type::overlay;
+          else if (value == "mmap")
+            opts.backend = backend_type::mmap;
+          else if (value == "nbd")
+            opts.backend = backend_type::nbd;
+          else
+            throw std::runtime_error(fmt::format("unknown disk backend {}", value));
+        } else if (key == "cache") {
+          if (value == "writeback")
+            opts.cache = cache_mode::writeback;
+          else if (value == "writethrough")
+            opts.cache = cache_mode::writethrough;
+          else
+            throw std::runtime_error(fmt::format("unknown cache mode {}", value));
+        } else if (key == "base") {
+          opts.base = value;
+        } else if (key == "export") {
+          opts.export_name = value;
+        } else if (key == "connections") {
+          opts.connections = std::stoul(value);
+          if (opts.connections == 0)
+            throw std::runtime_error("nbd disk needs at least one connection");
+        } else if (key == "readonly") {
+          opts.readonly = parse_bool(key, value);
+        } else if (key == "direct") {
+          opts.direct = parse_bool(key, value);
+        } else if (key == "cache_size") {
+          opts.cache_size = parse_size(key, value);
+        } else if (key == "trace_record") {
+          opts.trace_record = value;
+        } else if (key == "trace_seconds") {
+          opts.trace_seconds = std::stoul(value);
+        } else if (key == "prefetch") {
+          opts.prefetch = value;
+        } else if (key == "io_trace") {
+          opts.io_trace = value;
+        } else if (key == "iops") {
+          opts.iops = parse_size(key, value);
+        } else if (key == "iops_burst") {
+          opts.iops_burst = parse_size(key, value);
+        } else if (key == "bps") {
+          opts.bps = parse_size(key, value);
+        } else if (key == "bps_burst") {
+          opts.bps_burst = parse_size(key, value);
+        } else if (key == "queues") {
+          opts.queues = std::stoul(value);
+          if (opts.queues == 0)
+            throw std::runtime_error("disk needs at least one queue");
+        } else if (key == "pin") {
+          opts.pin = std::stoi(value);
+        } else if (key == "stats") {
+          opts.stats = value;
+        } else {
+          throw std::runtime_error(fmt::format("unknown disk option {}", key));
+        }
+      }
+
+      // every queue opens its own disk, only io_uring, mmap and nbd keep
+      // no state of their own that the others would need to see
+      const bool shared_nothing = opts.backend == backend_type::uring || opts.backend == backend_type::mmap ||
+                                  opts.backend == backend_type::nbd;
+      if (!shared_nothing && opts.queues > 1)
+        throw std::runtime_error("only the uring, mmap and nbd backends support multiple queues");
+      if (opts.cache_size && opts.queues > 1)
+        throw std::runtime_error("the block cache only supports a single queue");
+      if (opts.direct && opts.backend != backend_type::uring)
+        throw std::runtime_error("only the uring backend supports direct io");
+      if (opts.readonly && !shared_nothing)
+        throw std::runtime_error("only the uring, mmap and nbd backends support read-only disks");
+      if (opts.connections > 1 && opts.backend != backend_type::nbd)
+        throw std::runtime_error("only the nbd backend uses multiple connections");
+
+      return opts;
+    }
+
+    static bool parse_bool(const std::string &key, const std::string &value) {
+      if (value == "on" || value == "true" || value == "1")
+        return true;
+      if (value == "off" || value == "false" || value == "0")
+        return false;
+      throw std::runtime_error(fmt::format("invalid value {} for {}", value, key));
+    }
+
+    // bytes with an optional K, M or G suffix
+    static __u64 parse_size(const std::string &key, const std::string &value) {
+      size_t end = 0;
+      __u64 size = 0;
+      try {
+        size = std::stoull(value, &end);
+      } catch (const std::exception &) {
+        throw std::runtime_error(fmt::format("invalid value {} for {}", value, key));
+      }
+
+      const std::string suffix = value.substr(end);
+      if (suffix == "K" || suffix == "k")
+        return size << 10;
+      if (suffix == "M" || suffix == "m")
+        return size << 20;
+      if (suffix == "G" || suffix == "g")
+        return size << 30;
+      if (!suffix.empty())
+        throw std::runtime_error(fmt::format("invalid value {} for {}", value, key));
+      return size;
+    }
+  };
+
+} // namespace kvm::block
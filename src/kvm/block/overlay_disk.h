@@ -0,0 +1,443 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "kvm/memory.h"
+#include "kvm/util.h"
+
+#include "disk.h"
+
+namespace kvm::block {
+
+  // copy-on-write overlay on top of a read-only base image.
+  //
+  // the overlay file starts with a header page holding the base path,
+  // followed by a table with one entry per cluster and the clusters
+  // themselves. an entry is the file offset of the private copy of that
+  // cluster, 0 while reads still go to the base.
+  //
+  // new cluster data is made stable before the table entries pointing at
+  // it are written, so a crash never leaves an entry to a cluster that
+  // holds garbage. the clusters a request allocates share one sync, a
+  // flush makes the entries stable. with writeback caching the sync and
+  // the entries wait for the next flush or fua write instead.
+  class overlay_disk : public sync_disk {
+  public:
+    static constexpr char MAGIC[8] = {'K', 'T', 'H', 'X', 'C', 'O', 'W', '1'};
+    static constexpr __u64 HEADER_SIZE = 4096;
+    static constexpr __u32 CLUSTER_BITS = 16;
+
+    struct header {
+      char magic[8];
+      __u32 cluster_bits;
+      __u32 base_len; // base path follows the header
+      __u64 size;     // virtual disk size in bytes
+      __u64 table_offset;
+      __u64 table_entries;
+    };
+
+    // opens filename, creating an empty overlay over base if it does not
+    // exist yet
+    overlay_disk(const std::string &filename, const std::string &base_path, bool writeback)
+        : writeback(writeback) {
+      fd = open(filename.c_str(), O_RDWR | O_CLOEXEC);
+      if (fd < 0 && errno == ENOENT && !base_path.empty()) {
+        create(filename, base_path);
+        fd = open(filename.c_str(), O_RDWR | O_CLOEXEC);
+      }
+      if (fd < 0)
+        throw std::runtime_error(fmt::format("could not open file {}", filename));
+
+      if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw std::runtime_error(fmt::format("{} is not an overlay image", filename));
+      if (hdr.base_len > HEADER_SIZE - sizeof(hdr) || hdr.cluster_bits < 9 || hdr.cluster_bits > 24)
+        throw std::runtime_error(fmt::format("corrupt overlay header in {}", filename));
+
+      cluster_size = __u64(1) << hdr.cluster_bits;
+      if (hdr.table_entries != (hdr.size + cluster_size - 1) / cluster_size)
+        throw std::runtime_error(fmt::format("corrupt overlay header in {}", filename));
+
+      std::string base(hdr.base_len, '\0');
+      if (pread(fd, base.data(), base.size(), sizeof(hdr)) != ssize_t(base.size()))
+        throw std::runtime_error(fmt::format("corrupt overlay header in {}", filename));
+
+      // relative base paths are relative to the overlay
+      if (base.empty() || base[0] != '/') {
+        const size_t slash = filename.rfind('/');
+        if (slash != std::string::npos) {
+          base = filename.substr(0, slash + 1) + base;
+        }
+      }
+
+      base_fd = open(base.c_str(), O_RDONLY | O_CLOEXEC);
+      if (base_fd < 0)
+        throw std::runtime_error(fmt::format("could not open base image {}", base));
+
+      struct stat st;
+      if (fstat(base_fd, &st) < 0)
+        throw std::runtime_error(errno_msg("fstat"));
+      base_size = st.st_size;
+
+      table.resize(hdr.table_entries);
+      const ssize_t table_bytes = table.size() * sizeof(__u64);
+      if (pread(fd, table.data(), table_bytes, hdr.table_offset) != table_bytes)
+        throw std::runtime_error(fmt::format("could not read overlay table in {}", filename));
+
+      if (fstat(fd, &st) < 0)
+        throw std::runtime_error(errno_msg("fstat"));
+      const __u64 file_size = st.st_size;
+      const __u64 data_start = align(hdr.table_offset + table_bytes);
+
+      // entries are used as file offsets as they are, a bad one would
+      // read and write anywhere in the file
+      for (__u64 entry : table) {
+        if (entry && ((entry & (cluster_size - 1)) || entry < data_start || entry >= file_size ||
+                      file_size - entry < cluster_size))
+          throw std::runtime_error(fmt::format("corrupt overlay table in {}", filename));
+      }
+      next_cluster = std::max(align(file_size), data_start);
+
+      cluster_buf.resize(cluster_size);
+    }
+
+    ~overlay_disk() {
+      // best effort, a guest that cares has flushed
+      settle(0);
+      close(base_fd);
+      close(fd);
+    }
+
+    // writes a fresh overlay header and an empty table
+    static void create(const std::string &filename, const std::string &base_path) {
+      struct stat st;
+      if (stat(base_path.c_str(), &st) < 0)
+        throw std::runtime_error(fmt::format("could not stat base image {}", base_path));
+      if (base_path.size() > HEADER_SIZE - sizeof(header))
+        throw std::runtime_error(fmt::format("base image path too long {}", base_path));
+
+      const int out = open(filename.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+      if (out < 0)
+        throw std::runtime_error(fmt::format("could not create overlay {}", filename));
+
+      const __u64 cluster = __u64(1) << CLUSTER_BITS;
+
+      header h = {};
+      memcpy(h.magic, MAGIC, sizeof(MAGIC));
+      h.cluster_bits = CLUSTER_BITS;
+      h.base_len = base_path.size();
+      h.size = st.st_size;
+      h.table_offset = HEADER_SIZE;
+      h.table_entries = (h.size + cluster - 1) / cluster;
+
+      // the table is all zeroes, a sparse tail is enough
+      std::vector<__u8> page(HEADER_SIZE);
+      memcpy(page.data(), &h, sizeof(h));
+      memcpy(page.data() + sizeof(h), base_path.data(), base_path.size());
+
+      const bool ok = pwrite(out, page.data(), page.size(), 0) == ssize_t(page.size()) &&
+                      ftruncate(out, h.table_offset + h.table_entries * sizeof(__u64)) == 0 &&
+                      fsync(out) == 0;
+      close(out);
+      if (!ok)
+        throw std::runtime_error(errno_msg("overlay create"));
+    }
+
+    __u64 size() override {
+      return hdr.size;
+    }
+
+  protected:
+    void execute(request &req) override {
+      switch (req.type) {
+      case op::read:
+        req.result = read(req);
+        break;
+
+      case op::write:
+        req.result = write(req);
+        if (!writeback || req.fua) {
+          req.result = settle(req.result);
+        }
+        if (req.result >= 0 && req.fua && fdatasync(fd) < 0) {
+          req.result = -errno;
+        }
+        break;
+
+      case op::flush:
+        req.result = settle(0);
+        if (req.result >= 0 && fdatasync(fd) < 0) {
+          req.result = -errno;
+        }
+        break;
+
+      case op::discard:
+        // the base cannot be punched, and dropping private clusters would
+        // need a free list. discards are only hints.
+        req.result = 0;
+        break;
+
+      case op::write_zeroes:
+        req.result = write_zeroes(req);
+        if (!writeback) {
+          req.result = settle(req.result);
+        }
+        break;
+      }
+    }
+
+  private:
+    __u64 align(__u64 offset) {
+      return (offset + cluster_size - 1) & ~(cluster_size - 1);
+    }
+
+    // splits [offset, offset + len) into runs of clusters that map to one
+    // contiguous range, either in the overlay or in the base. fn gets the
+    // position within the request, the disk offset, the length and the
+    // overlay file offset or 0.
+    template <class F>
+    __s64 for_each_run(__u64 offset, __u64 len, F fn) {
+      __u64 pos = 0;
+      while (pos < len) {
+        const __u64 start = offset + pos;
+        const __u64 phys = translate(start);
+
+        __u64 run = std::min(len - pos, cluster_size - (start & (cluster_size - 1)));
+        while (pos + run < len) {
+          const __u64 next = translate(start + run);
+          if ((phys == 0) != (next == 0) || (phys && next != phys + run)) {
+            break;
+          }
+          run += std::min(len - pos - run, cluster_size);
+        }
+
+        const __s64 ret = fn(pos, start, run, phys);
+        if (ret < 0) {
+          return ret;
+        }
+        pos += run;
+      }
+      return len;
+    }
+
+    // overlay file offset of a disk offset, 0 if it is still in the base
+    __u64 translate(__u64 offset) {
+      const __u64 entry = table[offset >> hdr.cluster_bits];
+      return entry ? entry + (offset & (cluster_size - 1)) : 0;
+    }
+
+    __s64 read(request &req) {
+      return for_each_run(req.offset, iov_length(req.iov), [&](__u64 pos, __u64 offset, __u64 len, __u64 phys) -> __s64 {
+        segments.clear();
+        iov_slice(req.iov, pos, len, segments);
+        if (phys) {
+          return read_fully(fd, segments, phys, len);
+        }
+
+        // past the end of the base reads as zeroes
+        const __u64 avail = offset < base_size ? std::min(len, base_size - offset) : 0;
+        if (avail < len) {
+          zero(segments, avail, len - avail);
+        }
+        if (avail == 0) {
+          return 0;
+        }
+
+        std::vector<iovec> head;
+        iov_slice(segments, 0, avail, head);
+        return read_fully(base_fd, head, offset, avail);
+      });
+    }
+
+    __s64 write(request &req) {
+      return for_each_run(req.offset, iov_length(req.iov), [&](__u64 pos, __u64 offset, __u64 len, __u64 phys) -> __s64 {
+        segments.clear();
+        iov_slice(req.iov, pos, len, segments);
+        if (phys) {
+          return write_fully(fd, segments, phys, len);
+        }
+
+        // copy up cluster by cluster
+        __u64 done = 0;
+        while (done < len) {
+          const __u64 start = offset + done;
+          const __u64 within = start & (cluster_size - 1);
+          const __u64 chunk = std::min(len - done, cluster_size - within);
+
+          // a cluster written as a whole does not need the base
+          if (chunk != cluster_size) {
+            const __s64 ret = copy_up(start - within);
+            if (ret < 0) {
+              return ret;
+            }
+          }
+          iov_to_buf(segments, done, cluster_buf.data() + within, chunk);
+
+          const __s64 wret = commit_cluster(start - within);
+          if (wret < 0) {
+            return wret;
+          }
+          done += chunk;
+        }
+        return 0;
+      });
+    }
+
+    __s64 write_zeroes(request &req) {
+      for (const auto &ext : req.extents) {
+        const __s64 ret = for_each_run(ext.offset, ext.len, [&](__u64, __u64 offset, __u64 len, __u64 phys) -> __s64 {
+          if (phys) {
+            if (fallocate(fd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE, phys, len) == 0) {
+              return 0;
+            }
+            return pwrite_zeroes(fd, phys, len);
+          }
+
+          __u64 done = 0;
+          while (done < len) {
+            const __u64 start = offset + done;
+            const __u64 within = start & (cluster_size - 1);
+            const __u64 chunk = std::min(len - done, cluster_size - within);
+
+            // a cluster zeroed as a whole does not need the base
+            if (chunk == cluster_size) {
+              memset(cluster_buf.data(), 0, cluster_size);
+            } else {
+              const __s64 ret = copy_up(start - within);
+              if (ret < 0) {
+                return ret;
+              }
+              memset(cluster_buf.data() + within, 0, chunk);
+            }
+
+            const __s64 wret = commit_cluster(start - within);
+            if (wret < 0) {
+              return wret;
+            }
+            done += chunk;
+          }
+          return 0;
+        });
+
+        if (ret < 0) {
+          return ret;
+        }
+      }
+      return 0;
+    }
+
+    // fills cluster_buf with the base contents of the cluster at offset
+    __s64 copy_up(__u64 offset) {
+      memset(cluster_buf.data(), 0, cluster_size);
+      if (offset >= base_size) {
+        return 0;
+      }
+
+      const __u64 len = std::min(cluster_size, base_size - offset);
+      std::vector<iovec> buf = {{cluster_buf.data(), len}};
+      return read_fully(base_fd, buf, offset, len);
+    }
+
+    // writes cluster_buf to a new cluster. the in-memory table points at
+    // it right away, the entry on disk is left to settle.
+    __s64 commit_cluster(__u64 offset) {
+      const __u64 phys = next_cluster;
+      if (pwrite(fd, cluster_buf.data(), cluster_size, phys) != ssize_t(cluster_size)) {
+        return -EIO;
+      }
+
+      const __u64 index = offset >> hdr.cluster_bits;
+      table[index] = phys;
+      unsettled.push_back(index);
+      next_cluster += cluster_size;
+      return 0;
+    }
+
+    // syncs the clusters allocated since the last settle, then writes
+    // their table entries. runs even if the request failed half way, the
+    // clusters written so far are in use.
+    __s64 settle(__s64 result) {
+      if (unsettled.empty()) {
+        return result;
+      }
+
+      __s64 ret = fdatasync(fd) < 0 ? -errno : 0;
+      for (__u64 index : unsettled) {
+        if (ret < 0) {
+          break;
+        }
+        const __u64 phys = table[index];
+        if (pwrite(fd, &phys, sizeof(phys), hdr.table_offset + index * sizeof(__u64)) != sizeof(phys)) {
+          ret = -EIO;
+        }
+      }
+      unsettled.clear();
+      return result < 0 ? result : ret < 0 ? ret : result;
+    }
+
+    static void zero(const std::vector<iovec> &iov, __u64 offset, __u64 len) {
+      std::vector<iovec> tail;
+      iov_slice(iov, offset, len, tail);
+      for (const auto &v : tail) {
+        memset(v.iov_base, 0, v.iov_len);
+      }
+    }
+
+    // preadv and pwritev may stop short, pick up where they left off
+    static __s64 read_fully(int fd, const std::vector<iovec> &iov, __u64 offset, __u64 len) {
+      return transfer_fully(fd, iov, offset, len, false);
+    }
+
+    static __s64 write_fully(int fd, const std::vector<iovec> &iov, __u64 offset, __u64 len) {
+      return transfer_fully(fd, iov, offset, len, true);
+    }
+
+    static __s64 transfer_fully(int fd, const std::vector<iovec> &iov, __u64 offset, __u64 len, bool write) {
+      std::vector<iovec> rest;
+      __u64 done = 0;
+      while (done < len) {
+        rest.clear();
+        iov_slice(iov, done, len - done, rest);
+
+        const ssize_t ret = write ? pwritev(fd, rest.data(), rest.size(), offset + done)
+                                  : preadv(fd, rest.data(), rest.size(), offset + done);
+        if (ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if (ret <= 0) {
+          return ret < 0 ? -errno : -EIO;
+        }
+        done += ret;
+      }
+      return 0;
+    }
+
+    // cluster syncs and table entries wait for a flush
+    const bool writeback;
+
+    int fd;
+    int base_fd;
+    header hdr;
+    __u64 base_size;
+
+    __u64 cluster_size;
+    std::vector<__u64> table;
+    __u64 next_cluster;
+    // table entries whose clusters are not stable yet
+    std::vector<__u64> unsettled;
+
+    std::vector<__u8> cluster_buf;
+    std::vector<iovec> segments;
+  };
+
+} // namespace kvm::block
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <asm/types.h>
+
+namespace kvm::block {
+
+  // a counter with a single writer, readers may look at it any time
+  class counter {
+  public:
+    void add(__u64 n) {
+      value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void sub(__u64 n) {
+      value.store(value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+    }
+
+    __u64 get() const {
+      return value.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<__u64> value{0};
+  };
+
+  // latencies in power of two buckets, bucket n counts [2^n, 2^(n+1)) ns
+  class histogram {
+  public:
+    static constexpr size_t BUCKETS = 40;
+
+    void record(__u64 ns) {
+      const size_t bucket = ns ? std::min<size_t>(63 - __builtin_clzll(ns), BUCKETS - 1) : 0;
+      buckets[bucket].add(1);
+      total.add(1);
+    }
+
+    __u64 count() const {
+      return total.get();
+    }
+
+    // upper bound of the bucket holding the given percentile
+    __u64 percentile(double p) const {
+      const __u64 target = count() * p / 100;
+      __u64 seen = 0;
+      for (size_t i = 0; i < BUCKETS; i++) {
+        seen += buckets[i].get();
+        if (seen > target) {
+          return __u64(2) << i;
+        }
+      }
+      return __u64(2) << (BUCKETS - 1);
+    }
+
+    std::string format() const {
+      std::string out = fmt::format("count {} p50 {} p90 {} p99 {} buckets",
+                                    count(), percentile(50), percentile(90), percentile(99));
+      for (size_t i = 0; i < BUCKETS; i++) {
+        const __u64 n = buckets[i].get();
+        if (n) {
+          out += fmt::format(" {}:{}", __u64(1) << i, n);
+        }
+      }
+      return out;
+    }
+
+  private:
+    std::array<counter, BUCKETS> buckets;
+    counter total;
+  };
+
+  enum class stat_type {
+    read,
+    write,
+    flush,
+    discard,
+    write_zeroes,
+    other,
+  };
+
+  constexpr size_t STAT_TYPES = 6;
+  constexpr const char *STAT_TYPE_NAMES[STAT_TYPES] = {"read", "write", "flush", "discard", "write_zeroes", "other"};
+
+  // per queue numbers, written by the queue's worker only. total latency
+  // runs from taking the chain off the ring to publishing it as used,
+  // disk latency from submission to completion by the backend.
+  struct queue_stats {
+    counter reads;
+    counter writes;
+    counter bytes_read;
+    counter bytes_written;
+    counter errors;
+    counter in_flight;
+
+    std::array<histogram, STAT_TYPES> total;
+    std::array<histogram, STAT_TYPES> disk;
+
+    std::string format(__u32 index) const {
+      std::string out = fmt::format("queue {} reads {} writes {} bytes_read {} bytes_written {} errors {} in_flight {}\n",
+                                    index, reads.get(), writes.get(), bytes_read.get(), bytes_written.get(),
+                                    errors.get(), in_flight.get());
+
+      for (size_t i = 0; i < STAT_TYPES; i++) {
+        if (total[i].count()) {
+          out += fmt::format("queue {} {} total_ns {}\n", index, STAT_TYPE_NAMES[i], total[i].format());
+        }
+        if (disk[i].count()) {
+          out += fmt::format("queue {} {} disk_ns {}\n", index, STAT_TYPE_NAMES[i], disk[i].format());
+        }
+      }
+      return out;
+    }
+  };
+
+} // namespace kvm::block
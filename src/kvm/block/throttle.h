@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+#include <asm/types.h>
+
+namespace kvm::block {
+
+  // token buckets for operations and bytes per second, shared by all
+  // queues of a disk. a bucket holds at most its burst, a request is let
+  // through as soon as the bucket could cover it and may drive it into
+  // debt, so requests larger than the burst still make progress.
+  class throttle {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // a rate of 0 leaves that dimension unlimited, a burst of 0 defaults
+    // to one second worth of the rate
+    throttle(__u64 iops, __u64 iops_burst, __u64 bps, __u64 bps_burst)
+        : ops(iops, iops_burst)
+        , bytes(bps, bps_burst)
+        , last(clock::now()) {}
+
+    // takes the tokens for one request of len bytes, or returns how long
+    // to wait before asking again
+    bool admit(__u64 len, clock::duration &retry) {
+      const std::lock_guard<std::mutex> lock(mu);
+      refill();
+
+      const clock::duration wait = std::max(ops.wait_for(1), bytes.wait_for(len));
+      if (wait > clock::duration::zero()) {
+        retry = wait;
+        return false;
+      }
+
+      ops.take(1);
+      bytes.take(len);
+      return true;
+    }
+
+  private:
+    struct bucket {
+      bucket(__u64 rate, __u64 burst)
+          : rate(rate)
+          , burst(burst ? burst : rate)
+          , tokens(this->burst) {}
+
+      // zero once the bucket holds enough for cost, capped at a full bucket
+      clock::duration wait_for(__u64 cost) {
+        if (rate == 0) {
+          return clock::duration::zero();
+        }
+
+        const double needed = std::min<double>(cost, burst) - tokens;
+        if (needed <= 0) {
+          return clock::duration::zero();
+        }
+        return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(needed / rate)) +
+               clock::duration(1);
+      }
+
+      void take(__u64 cost) {
+        if (rate) {
+          tokens -= cost;
+        }
+      }
+
+      void add(double seconds) {
+        tokens = std::min<double>(burst, tokens + seconds * rate);
+      }
+
+      const __u64 rate;
+      const __u64 burst;
+      double tokens;
+    };
+
+    void refill() {
+      const clock::time_point now = clock::now();
+      const double seconds = std::chrono::duration<double>(now - last).count();
+      last = now;
+
+      ops.add(seconds);
+      bytes.add(seconds);
+    }
+
+    std::mutex mu;
+    bucket ops;
+    bucket bytes;
+    clock::time_point last;
+  };
+
+} // namespace kvm::block
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+
+#include <asm/types.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "kvm/util.h"
+
+namespace kvm::block {
+
+  // minimal io_uring wrapper on top of the raw syscalls. a ring is only
+  // ever driven by a single thread.
+  class uring {
+  public:
+    uring(__u32 entries) {
+      struct io_uring_params params;
+      memset(&params, 0, sizeof(params));
+
+      fd = syscall(__NR_io_uring_setup, entries, &params);
+      if (fd < 0)
+        throw std::runtime_error(errno_msg("io_uring_setup"));
+
+      sq_size = params.sq_off.array + params.sq_entries * sizeof(__u32);
+      cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+      if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+      }
+
+      sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+      if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+      } else {
+        cq_ptr = map(cq_size, IORING_OFF_CQ_RING);
+      }
+
+      sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+      sqes = reinterpret_cast<struct io_uring_sqe *>(map(sqes_size, IORING_OFF_SQES));
+
+      sq_head = ring_field(sq_ptr, params.sq_off.head);
+      sq_tail = ring_field(sq_ptr, params.sq_off.tail);
+      sq_mask = *ring_field(sq_ptr, params.sq_off.ring_mask);
+      sq_array = ring_field(sq_ptr, params.sq_off.array);
+      sq_entries = params.sq_entries;
+
+      cq_head = ring_field(cq_ptr, params.cq_off.head);
+      cq_tail = ring_field(cq_ptr, params.cq_off.tail);
+      cq_mask = *ring_field(cq_ptr, params.cq_off.ring_mask);
+      cqes = reinterpret_cast<struct io_uring_cqe *>(reinterpret_cast<__u8 *>(cq_ptr) + params.cq_off.cqes);
+
+      efd = eventfd(0, EFD_NONBLOCK);
+      if (efd < 0)
+        throw std::runtime_error(errno_msg("io_uring eventfd"));
+      if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+        throw std::runtime_error(errno_msg("IORING_REGISTER_EVENTFD"));
+    }
+
+    ~uring() {
+      munmap(sqes, sqes_size);
+      if (cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+      }
+      munmap(sq_ptr, sq_size);
+      close(efd);
+      close(fd);
+    }
+
+    // next free submission entry, nullptr if the ring is full
+    struct io_uring_sqe *get_sqe() {
+      const __u32 head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+      if (local_tail - head >= sq_entries) {
+        return nullptr;
+      }
+
+      const __u32 index = local_tail & sq_mask;
+      struct io_uring_sqe *sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+
+      sq_array[index] = index;
+      local_tail++;
+      return sqe;
+    }
+
+    // hands all entries from get_sqe to the kernel. entries the kernel
+    // did not take, on a short submit or EAGAIN/EBUSY, stay between
+    // sq_head and the tail and go in with the next call.
+    int submit() {
+      __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+
+      int submitted = 0;
+      while (true) {
+        const __u32 pending = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (pending == 0) {
+          break;
+        }
+
+        const int ret = syscall(__NR_io_uring_enter, fd, pending, 0, 0, nullptr, 0);
+        if (ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EBUSY)) {
+          break;
+        }
+        if (ret < 0)
+          throw std::runtime_error(errno_msg("io_uring_enter"));
+        if (ret == 0) {
+          break;
+        }
+        submitted += ret;
+      }
+      return submitted;
+    }
+
+    // calls fn for every completion and retires them
+    template <class F>
+    size_t reap(F fn) {
+      __u64 value = 0;
+      if (::read(efd, &value, 8) < 0) {
+        // nothing signalled, the ring may still hold completions
+      }
+
+      __u32 head = *cq_head;
+      const __u32 tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+      size_t count = 0;
+      for (; head != tail; head++, count++) {
+        fn(cqes[head & cq_mask]);
+      }
+
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+      return count;
+    }
+
+    // readable while completions are pending
+    int event_fd() {
+      return efd;
+    }
+
+  private:
+    void *map(size_t size, __u64 offset) {
+      void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+      if (ptr == MAP_FAILED)
+        throw std::runtime_error(errno_msg("io_uring mmap"));
+      return ptr;
+    }
+
+    __u32 *ring_field(void *ring, __u32 offset) {
+      return reinterpret_cast<__u32 *>(reinterpret_cast<__u8 *>(ring) + offset);
+    }
+
+    int fd;
+    int efd;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+
+    __u32 *sq_head;
+    __u32 *sq_tail;
+    __u32 *sq_array;
+    __u32 sq_mask;
+    __u32 sq_entries;
+    __u32 local_tail = 0;
+    struct io_uring_sqe *sqes;
+
+    __u32 *cq_head;
+    __u32 *cq_tail;
+    __u32 cq_mask;
+    struct io_uring_cqe *cqes;
+  };
+
+} // namespace kvm::block
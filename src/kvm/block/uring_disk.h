@@ -0,0 +1,132 @@
+#pragma once
+
+#include <deque>
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "uring.h"
+
+namespace kvm::block {
+
+  // submits vectored reads and writes straight from the request iovecs,
+  // any number of them may be in flight at once.
+  class uring_disk : public disk {
+  public:
+    static constexpr __u32 RING_ENTRIES = 512;
+
+    uring_disk(const std::string &filename, bool direct = false, bool readonly = false)
+        : fd(open(filename.c_str(), (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC | (direct ? O_DIRECT : 0)))
+        , ring(RING_ENTRIES) {
+      if (fd < 0)
+        throw std::runtime_error(fmt::format("could not open file {}", filename));
+
+      struct stat st;
+      if (fstat(fd, &st) < 0)
+        throw std::runtime_error(errno_msg("fstat"));
+      file_size = st.st_size;
+    }
+
+    ~uring_disk() {
+      close(fd);
+    }
+
+    __u64 size() override {
+      return file_size;
+    }
+
+    void submit(request *req) override {
+      // fallocate only touches metadata, not worth a trip through the ring
+      if (req->type == op::discard || req->type == op::write_zeroes) {
+        req->result = fallocate_extents(fd, *req);
+        completed.push_back(req);
+        return;
+      }
+      backlog.push_back(req);
+    }
+
+    void flush_submissions() override {
+      while (!backlog.empty()) {
+        struct io_uring_sqe *sqe = ring.get_sqe();
+        if (sqe == nullptr) {
+          break;
+        }
+
+        request *req = backlog.front();
+        backlog.pop_front();
+        prepare(sqe, req);
+      }
+      ring.submit();
+    }
+
+    size_t reap(std::vector<request *> &done) override {
+      const size_t count = ring.reap([&](const struct io_uring_cqe &cqe) {
+        request *req = reinterpret_cast<request *>(cqe.user_data);
+        req->result = cqe.res;
+        done.push_back(req);
+      });
+
+      // completions freed up ring space for anything left over
+      if (count && !backlog.empty()) {
+        flush_submissions();
+      }
+
+      const size_t sync_count = completed.size();
+      done.insert(done.end(), completed.begin(), completed.end());
+      completed.clear();
+      return count + sync_count;
+    }
+
+    int event_fd() override {
+      return ring.event_fd();
+    }
+
+  private:
+    void prepare(struct io_uring_sqe *sqe, request *req) {
+      switch (req->type) {
+      case op::read:
+        sqe->opcode = IORING_OP_READV;
+        break;
+      case op::write:
+        sqe->opcode = IORING_OP_WRITEV;
+        if (req->fua) {
+          sqe->rw_flags = RWF_DSYNC;
+        }
+        break;
+      case op::flush:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+      case op::discard:
+      case op::write_zeroes:
+        // completed within submit(), never queued
+        break;
+      }
+
+      sqe->fd = fd;
+      sqe->user_data = reinterpret_cast<__u64>(req);
+      if (req->type == op::flush) {
+        return;
+      }
+
+      sqe->addr = reinterpret_cast<__u64>(req->iov.data());
+      sqe->len = req->iov.size();
+      sqe->off = req->offset;
+    }
+
+    int fd;
+    __u64 file_size;
+
+    uring ring;
+    std::deque<request *> backlog;
+    std::vector<request *> completed;
+  };
+
+} // namespace kvm::block
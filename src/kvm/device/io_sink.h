@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+
+#include <asm/types.h>
+#include <fmt/format.h>
+
+#include "io_device.h"
+
+namespace kvm::device {
+
+  // claims a port range without emulating anything behind it.
+  // reads return zero, writes are dropped.
+  class io_sink : public io_device {
+  public:
+    io_sink(__u64 addr, __u64 width, ::kvm::interrupt *irq, bool verbose = false)
+        : io_device(addr, width, irq)
+        , verbose(verbose) {}
+
+    std::vector<__u8> read(__u64 offset, __u32 size) override {
+      if (verbose) {
+        fmt::print("kvm::device::io_sink in port {:#x} size {}\n", addr + offset, size);
+      }
+      return std::vector<__u8>(size);
+    }
+
+    void write(__u8 *data, __u64 offset, __u32 size) override {
+      if (verbose) {
+        fmt::print("kvm::device::io_sink out port {:#x} size {} value {:#x}\n", addr + offset, size, data[0]);
+      }
+    }
+
+  private:
+    bool verbose;
+  };
+
+} // namespace kvm::device
@@ -10,33 +10,60 @@
 
 namespace kvm {
 
+  // a level triggered line driven through an irqfd.
+  //
+  // with KVM_IRQFD_FLAG_RESAMPLE the kernel keeps the line asserted until
+  // the guest EOIs it and then signals resample_fd, at which point a still
+  // pending interrupt is raised again. the guest clears the pending state
+  // through ack_fd, which is bound to an ioeventfd on the devices ack register.
   class interrupt {
   public:
     interrupt(__u32 num)
         : number(num)
         , fd(eventfd(0, 0))
+        , resample(eventfd(0, EFD_NONBLOCK))
+        , ack(eventfd(0, EFD_NONBLOCK))
         , state(false) {}
 
+    ~interrupt() {
+      close(fd);
+      close(resample);
+      close(ack);
+    }
+
     void set_level(bool update) {
       const std::lock_guard<std::mutex> lock(mu);
+      drain_ack();
       if (state == update) {
         return;
       }
       if (update) {
-        __u64 value = 0x1;
-        ssize_t ret = write(fd, &value, 8);
-        if (ret < 0) {
-          throw std::runtime_error(errno_msg("eventfd write failed"));
-        }
+        raise();
       }
       state = update;
     }
 
     bool level() {
       const std::lock_guard<std::mutex> lock(mu);
+      drain_ack();
       return state;
     }
 
+    // the guest EOIed the line and the kernel deasserted it
+    void resampled() {
+      const std::lock_guard<std::mutex> lock(mu);
+
+      __u64 value = 0;
+      if (read(resample, &value, 8) != 8) {
+        return;
+      }
+
+      drain_ack();
+      if (state) {
+        raise();
+      }
+    }
+
     __u32 num() {
       return number;
     }
@@ -45,11 +72,36 @@ namespace kvm {
       return fd;
     }
 
+    __u32 resample_fd() {
+      return resample;
+    }
+
+    __u32 ack_fd() {
+      return ack;
+    }
+
   private:
+    void raise() {
+      __u64 value = 0x1;
+      ssize_t ret = write(fd, &value, 8);
+      if (ret < 0) {
+        throw std::runtime_error(errno_msg("eventfd write failed"));
+      }
+    }
+
+    void drain_ack() {
+      __u64 value = 0;
+      if (read(ack, &value, 8) == 8) {
+        state = false;
+      }
+    }
+
     std::mutex mu;
 
     __u32 number;
     __u32 fd;
+    __u32 resample;
+    __u32 ack;
 
     bool state;
   };
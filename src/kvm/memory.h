@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <asm/types.h>
+#include <sys/uio.h>
+
+namespace kvm {
+
+  // guest physical to host address translation for the kvm memory slots
+  class memory_map {
+  public:
+    struct region {
+      __u64 guest_addr;
+      __u64 size;
+      __u8 *host;
+      // file backing the region and the region's offset in it, so other
+      // processes can map the same memory. -1 for private memory.
+      int fd;
+      __u64 fd_offset;
+    };
+
+    void add_region(__u64 guest_addr, __u64 size, __u8 *host, int fd = -1, __u64 fd_offset = 0) {
+      regions.push_back({guest_addr, size, host, fd, fd_offset});
+      std::sort(regions.begin(), regions.end(), [](const region &a, const region &b) {
+        return a.guest_addr < b.guest_addr;
+      });
+    }
+
+    // host address of [addr, addr + len) if it lies within a single region
+    __u8 *translate(__u64 addr, __u64 len) {
+      const region *r = find(addr);
+      if (r == nullptr || len > r->guest_addr + r->size - addr) {
+        return nullptr;
+      }
+      return r->host + (addr - r->guest_addr);
+    }
+
+    // appends iovecs for [addr, addr + len), split at region boundaries.
+    // returns the number of bytes mapped, stopping at the first hole.
+    __u64 to_iovec(__u64 addr, __u64 len, std::vector<iovec> &iov) {
+      __u64 mapped = 0;
+      while (mapped < len) {
+        const region *r = find(addr + mapped);
+        if (r == nullptr) {
+          break;
+        }
+
+        const __u64 offset = addr + mapped - r->guest_addr;
+        const __u64 chunk = std::min(len - mapped, r->size - offset);
+        iov.push_back({r->host + offset, chunk});
+        mapped += chunk;
+      }
+      return mapped;
+    }
+
+    const std::vector<region> &get_regions() {
+      return regions;
+    }
+
+  private:
+    const region *find(__u64 addr) {
+      auto it = std::upper_bound(regions.begin(), regions.end(), addr, [](__u64 addr, const region &r) {
+        return addr < r.guest_addr;
+      });
+      if (it == regions.begin()) {
+        return nullptr;
+      }
+
+      --it;
+      if (addr - it->guest_addr >= it->size) {
+        return nullptr;
+      }
+      return &*it;
+    }
+
+    std::vector<region> regions;
+  };
+
+  inline size_t iov_length(const std::vector<iovec> &iov) {
+    size_t len = 0;
+    for (const auto &v : iov) {
+      len += v.iov_len;
+    }
+    return len;
+  }
+
+  // appends the part of iov covering [offset, offset + len) to out
+  inline void iov_slice(const std::vector<iovec> &iov, size_t offset, size_t len, std::vector<iovec> &out) {
+    for (const auto &v : iov) {
+      if (len == 0) {
+        break;
+      }
+      if (offset >= v.iov_len) {
+        offset -= v.iov_len;
+        continue;
+      }
+
+      const size_t chunk = std::min(len, v.iov_len - offset);
+      out.push_back({reinterpret_cast<__u8 *>(v.iov_base) + offset, chunk});
+      offset = 0;
+      len -= chunk;
+    }
+  }
+
+  inline size_t iov_to_buf(const std::vector<iovec> &iov, size_t offset, void *buf, size_t len) {
+    size_t done = 0;
+    for (const auto &v : iov) {
+      if (done == len) {
+        break;
+      }
+      if (offset >= v.iov_len) {
+        offset -= v.iov_len;
+        continue;
+      }
+
+      const size_t chunk = std::min(len - done, v.iov_len - offset);
+      memcpy(reinterpret_cast<__u8 *>(buf) + done, reinterpret_cast<__u8 *>(v.iov_base) + offset, chunk);
+      offset = 0;
+      done += chunk;
+    }
+    return done;
+  }
+
+  inline size_t buf_to_iov(const std::vector<iovec> &iov, size_t offset, const void *buf, size_t len) {
+    size_t done = 0;
+    for (const auto &v : iov) {
+      if (done == len) {
+        break;
+      }
+      if (offset >= v.iov_len) {
+        offset -= v.iov_len;
+        continue;
+      }
+
+      const size_t chunk = std::min(len - done, v.iov_len - offset);
+      memcpy(reinterpret_cast<__u8 *>(v.iov_base) + offset, reinterpret_cast<const __u8 *>(buf) + done, chunk);
+      offset = 0;
+      done += chunk;
+    }
+    return done;
+  }
+
+} // namespace kvm
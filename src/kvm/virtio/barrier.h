@@ -1,5 +1,33 @@
 #pragma once
 
-#define mb()	asm volatile ("mfence": : :"memory")
-#define rmb()	asm volatile ("lfence": : :"memory")
-#define wmb()	asm volatile ("sfence": : :"memory")
\ No newline at end of file
+#include <atomic>
+
+namespace kvm::virtio {
+
+  // the ring is shared with the guest driver, which follows the virtio
+  // memory model: acquire/release pairs around the indices and a full
+  // fence only where a store has to be ordered before a later load.
+
+  inline void mb() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  inline void rmb() {
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+
+  inline void wmb() {
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  template <class T>
+  inline T load_acquire(T *ptr) {
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+  }
+
+  template <class T>
+  inline void store_release(T *ptr, T value) {
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+  }
+
+} // namespace kvm::virtio
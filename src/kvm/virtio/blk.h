@@ -1,49 +1,145 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <fmt/format.h>
 
 #include <asm/types.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include <linux/virtio_blk.h>
 #include <linux/virtio_config.h>
 
 #include <vring_def.h>
 
+#include "kvm/block/block.h"
+
 #include "device.h"
 
 namespace kvm::virtio {
 
   constexpr char DISK_ID[] = "kthxvmkthxvmkthxvmdisk";
-
-  class blk : public queue_device<VIRTIO_ID_BLOCK, 1> {
+  constexpr __u32 BLK_QUEUES_MAX = 16;
+  // limits for a single discard or write zeroes request
+  constexpr __u32 BLK_DISCARD_SECTORS_MAX = 1 << 22;
+  constexpr __u32 BLK_DISCARD_SEG_MAX = 32;
+  // logical block size advertised for disks opened with O_DIRECT
+  constexpr __u32 BLK_DIRECT_BLOCK_SIZE = 4096;
+  // prefetch reads in flight, and pool entries always left to the guest
+  constexpr size_t BLK_PREFETCH_DEPTH = 8;
+  constexpr size_t BLK_PREFETCH_RESERVE = queue::QUEUE_SIZE_MAX / 2;
+  // largest host io built out of adjacent requests
+  constexpr __u64 BLK_MERGE_MAX = 1 << 20;
+
+  class blk : public queue_device<VIRTIO_ID_BLOCK, BLK_QUEUES_MAX> {
   public:
+    using clock = std::chrono::steady_clock;
+
     struct req_header {
       __u32 type;
       __u32 reserved;
       __u64 sector;
     };
 
-    blk(::kvm::interrupt *irq, __u8 *ptr, std::string filename)
-        : queue_device<VIRTIO_ID_BLOCK, 1>(irq, ptr)
-        , file(filename, std::ios::binary | std::ios::in | std::ios::out) {
+    // spec is the image path, optionally followed by ",key=value" options
+    blk(::kvm::interrupt *irq, ::kvm::memory_map *mem, std::string spec)
+        : blk(irq, mem, block::options::parse(spec)) {}
 
-      if (!file.is_open())
-        throw std::runtime_error(fmt::format("could not open file {}", filename));
+    blk(::kvm::interrupt *irq, ::kvm::memory_map *mem, block::options options)
+        : queue_device<VIRTIO_ID_BLOCK, BLK_QUEUES_MAX>(irq, mem, options.queues)
+        , opts(options) {
+
+      if (opts.queues > BLK_QUEUES_MAX)
+        throw std::runtime_error(fmt::format("disk supports at most {} queues", BLK_QUEUES_MAX));
+
+      for (__u32 i = 0; i < num_queues(); i++) {
+        workers.emplace_back(std::make_unique<worker>(i, q(i), block::open_disk(opts)));
+      }
 
       // 512 blocks
-      file.seekg(0, std::ios::end);
-      config.capacity = file.tellg() / 512;
+      disk_size = workers[0]->disk->size();
+      capacity = disk_size / 512;
+      config.capacity = capacity;
       config.size_max = 32768;
-      config.seg_max = queue::QUEUE_SIZE_MAX / 2;
+      // header and status take up one descriptor each, with indirect
+      // descriptors the whole request still only uses one ring slot
+      config.seg_max = queue::QUEUE_SIZE_MAX - 2;
+      // the guest may switch a write-back disk to write-through
+      config.wce = opts.cache == block::cache_mode::writeback;
+      config.num_queues = num_queues();
+      config.max_discard_sectors = BLK_DISCARD_SECTORS_MAX;
+      config.max_discard_seg = BLK_DISCARD_SEG_MAX;
+      config.discard_sector_alignment = 8;
+      config.max_write_zeroes_sectors = BLK_DISCARD_SECTORS_MAX;
+      config.max_write_zeroes_seg = BLK_DISCARD_SEG_MAX;
+      config.write_zeroes_may_unmap = 1;
+      // keeps guest io aligned for O_DIRECT
+      if (opts.direct) {
+        config.blk_size = BLK_DIRECT_BLOCK_SIZE;
+      }
+
+      if (opts.iops || opts.bps) {
+        limiter = std::make_unique<block::throttle>(opts.iops, opts.iops_burst, opts.bps, opts.bps_burst);
+      }
 
-      run_thread = std::thread(&blk::run, this);
+      // loaded before the recorder truncates it, so a disk may record
+      // to the trace it prefetches from
+      if (!opts.prefetch.empty()) {
+        workers[0]->prefetch = block::boot_trace::load(opts.prefetch, disk_size);
+        fmt::print("kvm::virtio::blk prefetching {} extents from {}\n", workers[0]->prefetch.size(), opts.prefetch);
+      }
+      if (!opts.trace_record.empty()) {
+        recorder = std::make_unique<block::boot_trace::recorder>(opts.trace_record, opts.trace_seconds);
+      }
+      if (!opts.io_trace.empty()) {
+        tracer = std::make_unique<block::io_trace::writer>(opts.io_trace);
+      }
+
+      for (__u32 i = 0; i < num_queues(); i++) {
+        worker &w = *workers[i];
+        w.thread = std::thread(&blk::run, this, std::ref(w));
+        if (opts.pin >= 0) {
+          pin(w.thread, (opts.pin + i) % std::thread::hardware_concurrency());
+        }
+      }
+
+      if (!opts.stats.empty()) {
+        stats_thread = std::thread(&blk::export_stats, this);
+      }
     }
 
     ~blk() {
       should_run = false;
-      run_thread.join();
+      for (auto &w : workers) {
+        {
+          std::lock_guard<std::mutex> guard(w->lock);
+          w->cond.notify_all();
+        }
+        w->thread.join();
+      }
+      if (stats_thread.joinable()) {
+        stats_thread.join();
+      }
+
+      if (auto cache = dynamic_cast<block::cache_disk *>(workers[0]->disk.get())) {
+        const auto &stats = cache->stats();
+        fmt::print("kvm::virtio::blk cache {} hits {} misses {} pages read ahead {} evictions\n",
+                   stats.hits.load(), stats.misses.load(), stats.readahead.load(), stats.evictions.load());
+      }
     }
 
     std::vector<__u8> read(__u64 offset, __u32 size) {
@@ -58,105 +154,645 @@ namespace kvm::virtio {
       return buf;
     }
 
+    // wce is the only field the driver may change, everything else in
+    // the config describes the disk
     void write(__u8 *data, __u64 offset, __u32 size) {
-      if ((offset + size) > sizeof(virtio_blk_config)) {
+      if (offset != offsetof(virtio_blk_config, wce) || size != 1 || data[0] > 1) {
         fmt::print("kvm::virtio::blk invalid config write at {:#x}\n", offset);
         return;
       }
 
-      memcpy((uint8_t *)(&config) + offset, data, size);
+      __atomic_store_n(&config.wce, data[0], __ATOMIC_RELAXED);
       generation++;
     }
 
     __u32 features() {
-      return (1UL << VIRTIO_BLK_F_SIZE_MAX) |
-             (1UL << VIRTIO_BLK_F_SEG_MAX) |
-             (1UL << VIRTIO_RING_F_EVENT_IDX);
+      __u32 features = (1UL << VIRTIO_BLK_F_SIZE_MAX) |
+                       (1UL << VIRTIO_BLK_F_SEG_MAX) |
+                       (1UL << VIRTIO_RING_F_EVENT_IDX);
+
+      if (num_queues() > 1) {
+        features |= (1UL << VIRTIO_BLK_F_MQ);
+      }
+      if (opts.direct) {
+        features |= (1UL << VIRTIO_BLK_F_BLK_SIZE);
+      }
+      if (opts.readonly) {
+        features |= (1UL << VIRTIO_BLK_F_RO);
+      } else {
+        features |= (1UL << VIRTIO_BLK_F_DISCARD) |
+                    (1UL << VIRTIO_BLK_F_WRITE_ZEROES);
+      }
+
+      // without FLUSH the guest treats the disk as write-through
+      if (opts.cache == block::cache_mode::writeback) {
+        features |= (1UL << VIRTIO_BLK_F_FLUSH) |
+                    (1UL << VIRTIO_BLK_F_CONFIG_WCE);
+      }
+      return features;
     }
 
     __u32 config_generation() {
       return generation;
     }
 
-    void run() {
+    // stops queue index and returns once its worker has completed every
+    // chain it took off the ring. the worker then leaves the ring and its
+    // eventfds alone until resume.
+    void quiesce(__u32 index) {
+      worker &w = *workers.at(index);
+      w.rq.stop();
+      w.quiesce.store(true, std::memory_order_release);
+      // wakes the worker if it is waiting for a kick
+      w.rq.set_notify();
+
+      std::unique_lock<std::mutex> guard(w.lock);
+      w.cond.wait(guard, [&] { return w.parked; });
+    }
+
+    void resume(__u32 index) {
+      worker &w = *workers.at(index);
+      std::lock_guard<std::mutex> guard(w.lock);
+      w.quiesce.store(false, std::memory_order_release);
+      w.cond.notify_all();
+    }
+
+    // counters and latency histograms of every queue, and its cache
+    // counters if it has one. safe to call while the workers run.
+    std::string format_stats() {
+      std::string out;
+      for (__u32 i = 0; i < workers.size(); i++) {
+        out += workers[i]->stats.format(i);
+        if (auto cache = dynamic_cast<block::cache_disk *>(workers[i]->disk.get())) {
+          const auto &stats = cache->stats();
+          out += fmt::format("queue {} cache hits {} misses {} readahead {} evictions {}\n", i,
+                             stats.hits.load(), stats.misses.load(), stats.readahead.load(), stats.evictions.load());
+        }
+      }
+      return out;
+    }
+
+  private:
+    struct blk_request : block::request {
+      queue::chain_t chain;
+      size_t status_offset;
+      __u8 status;
+      // handed to the disk, as opposed to completed on the spot
+      bool io;
+      // set while the entry is used for a prefetch rather than a chain
+      __u8 *scratch = nullptr;
+
+      // bytes this chain itself reads or writes
+      __u64 data_len;
+      // adjacent requests that ride along in this one's host io, their
+      // iovecs follow this request's own
+      std::vector<blk_request *> merged;
+
+      block::stat_type stat;
+      clock::time_point harvested;
+      clock::time_point submitted;
+    };
+
+    // everything one queue needs, only touched by its own thread
+    struct worker {
+      worker(__u32 index, queue &rq, std::unique_ptr<block::disk> disk)
+          : index(index)
+          , rq(rq)
+          , disk(std::move(disk))
+          , pool(queue::QUEUE_SIZE_MAX) {
+        for (auto &req : pool) {
+          free_list.push_back(&req);
+        }
+        for (size_t i = 0; i < BLK_PREFETCH_DEPTH; i++) {
+          scratch.push_back(static_cast<__u8 *>(aligned_alloc(BLK_DIRECT_BLOCK_SIZE, block::boot_trace::PREFETCH_CHUNK)));
+        }
+      }
+
+      ~worker() {
+        for (__u8 *buf : scratch) {
+          free(buf);
+        }
+      }
+
+      const __u32 index;
+      queue &rq;
+      std::unique_ptr<block::disk> disk;
+
+      std::vector<blk_request> pool;
+      std::vector<blk_request *> free_list;
+      std::vector<block::request *> immediate;
+      std::vector<blk_request *> pending;
+      // over the rate limit, in arrival order
+      std::deque<blk_request *> throttled;
+      block::throttle::clock::time_point retry_at;
+      std::vector<block::request *> done;
+      std::vector<blk_request *> finished;
+      std::vector<queue::chain_t *> completed;
+
+      block::queue_stats stats;
+      // this round's io trace records
+      std::vector<block::io_trace::record> traced;
+
+      // boot trace extents still to prefetch, and their buffers
+      std::vector<block::extent> prefetch;
+      size_t prefetch_next = 0;
+      std::vector<__u8 *> scratch;
+
+      // quiesce handshake, parked is set once nothing taken off the ring
+      // is left in flight
+      std::atomic_bool quiesce = false;
+      bool parked = false;
+      std::mutex lock;
+      std::condition_variable cond;
+
+      std::thread thread;
+    };
+
+    // chains taken off the ring and not yet used, prefetches aside
+    static size_t chains_in_flight(const worker &w) {
+      return w.pool.size() - w.free_list.size() - (BLK_PREFETCH_DEPTH - w.scratch.size());
+    }
+
+    // until resume, or until the device goes away
+    void park(worker &w) {
+      std::unique_lock<std::mutex> guard(w.lock);
+      w.parked = true;
+      w.cond.notify_all();
+      w.cond.wait(guard, [&] { return !w.quiesce.load(std::memory_order_acquire) || !should_run; });
+      w.parked = false;
+    }
+
+    void run(worker &w) {
+      queue &rq = w.rq;
+      std::vector<blk_request *> &free_list = w.free_list;
+
       while (should_run) {
-        queue::descriptor_elem_t *next = q().next();
-        if (next == nullptr) {
-          std::this_thread::sleep_for(std::chrono::microseconds(10));
+        if (w.quiesce.load(std::memory_order_acquire) && chains_in_flight(w) == 0) {
+          park(w);
           continue;
         }
 
-        __u32 len = 0;
-        __u32 desc_start = q().avail_id();
-
-        req_header *hdr = q().translate<req_header>(next->addr);
-        switch (hdr->type) {
-        case VIRTIO_BLK_T_IN: {
-          next = &q().desc()->ring[next->next];
+        // keep the disk busy with as many chains as the pool allows
+        const clock::time_point now = clock::now();
+        size_t started = 0;
+        while (!free_list.empty()) {
+          blk_request *req = free_list.back();
+          if (!rq.next(req->chain)) {
+            break;
+          }
+          free_list.pop_back();
+          req->harvested = now;
+          w.stats.in_flight.add(1);
+          start(w, req);
+          started++;
+        }
+        submit_pending(w);
+        started += prefetch(w);
+        w.disk->flush_submissions();
+
+        w.done.clear();
+        w.disk->reap(w.done);
+        w.done.insert(w.done.end(), w.immediate.begin(), w.immediate.end());
+        w.immediate.clear();
+
+        if (w.done.empty()) {
+          if (started == 0) {
+            wait(w);
+          }
+          continue;
+        }
 
-          file.seekg(hdr->sector * 512);
-          while (next->flags & VRING_DESC_F_NEXT) {
-            file.read(q().translate<char>(next->addr), next->len);
-            len += next->len;
-            next = &q().desc()->ring[next->next];
+        const clock::time_point reaped = clock::now();
+        w.finished.clear();
+        for (block::request *r : w.done) {
+          blk_request *req = static_cast<blk_request *>(r);
+          if (req->scratch) {
+            w.scratch.push_back(req->scratch);
+            req->scratch = nullptr;
+            free_list.push_back(req);
+            continue;
           }
 
-          *q().translate<__u8>(next->addr) = VIRTIO_BLK_S_OK;
-          len += 1;
-          break;
+          split_merged(req);
+          w.finished.insert(w.finished.end(), req->merged.begin(), req->merged.end());
+          w.finished.push_back(req);
+          req->merged.clear();
         }
 
-        case VIRTIO_BLK_T_OUT: {
-          next = &q().desc()->ring[next->next];
+        w.completed.clear();
+        for (blk_request *req : w.finished) {
+          finish(req);
+          w.completed.push_back(&req->chain);
+        }
 
-          file.seekp(hdr->sector * 512);
-          while (next->flags & VRING_DESC_F_NEXT) {
-            file.write(q().translate<char>(next->addr), next->len);
-            file.flush();
-            len += next->len;
-            next = &q().desc()->ring[next->next];
+        if (rq.add_used_batch(w.completed)) {
+          signal(rq);
+        }
+
+        const clock::time_point published = clock::now();
+        for (blk_request *req : w.finished) {
+          account(w.stats, req, reaped, published);
+          if (tracer && req->io) {
+            trace(w, req, published);
           }
+          free_list.push_back(req);
+        }
+        if (tracer) {
+          tracer->append(w.traced);
+          w.traced.clear();
+        }
+      }
+    }
 
-          *q().translate<__u8>(next->addr) = VIRTIO_BLK_S_OK;
-          len += 1;
-          break;
+    void account(block::queue_stats &stats, const blk_request *req, clock::time_point reaped, clock::time_point published) {
+      const size_t type = size_t(req->stat);
+      stats.total[type].record(std::chrono::duration_cast<std::chrono::nanoseconds>(published - req->harvested).count());
+      if (req->io) {
+        stats.disk[type].record(std::chrono::duration_cast<std::chrono::nanoseconds>(reaped - req->submitted).count());
+      }
+
+      if (req->status != VIRTIO_BLK_S_OK) {
+        stats.errors.add(1);
+      } else if (req->stat == block::stat_type::read) {
+        stats.reads.add(1);
+        stats.bytes_read.add(req->data_len);
+      } else if (req->stat == block::stat_type::write) {
+        stats.writes.add(1);
+        stats.bytes_written.add(req->data_len);
+      }
+      stats.in_flight.sub(1);
+    }
+
+    // one record per request, discard and write zeroes get one per extent
+    void trace(worker &w, const blk_request *req, clock::time_point published) {
+      block::io_trace::record rec = {};
+      rec.time = tracer->since_start(req->harvested);
+      rec.latency = std::chrono::duration_cast<std::chrono::nanoseconds>(published - req->harvested).count();
+      rec.type = __u8(req->type);
+      rec.queue = w.index;
+
+      if (req->extents.empty()) {
+        if (req->type != block::op::flush) {
+          rec.sector = req->offset / 512;
+          rec.len = req->data_len;
         }
+        w.traced.push_back(rec);
+        return;
+      }
+      for (const auto &ext : req->extents) {
+        rec.sector = ext.offset / 512;
+        rec.len = ext.len;
+        w.traced.push_back(rec);
+      }
+    }
 
-        case VIRTIO_BLK_T_GET_ID: {
-          next = &q().desc()->ring[next->next];
-          memcpy(q().translate<char>(next->addr), DISK_ID, next->len);
-          len += next->len;
+    // rewrites the stats file once a second and once more on shutdown
+    void export_stats() {
+      auto next = clock::now();
+      while (should_run) {
+        if (clock::now() < next) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          continue;
+        }
+        next += std::chrono::seconds(1);
+        write_stats();
+      }
+      write_stats();
+    }
+
+    // through a rename, so readers never see the file half written
+    void write_stats() {
+      const std::string tmp = opts.stats + ".tmp";
+      std::ofstream file(tmp, std::ios::out | std::ios::trunc);
+      file << format_stats();
+      file.close();
+      if (!file || rename(tmp.c_str(), opts.stats.c_str()) < 0) {
+        fmt::print("kvm::virtio::blk could not write stats to {}\n", opts.stats);
+      }
+    }
+
+    // reads the next boot trace extents into scratch buffers, only while
+    // the guest leaves enough of the pool free
+    size_t prefetch(worker &w) {
+      size_t issued = 0;
+      while (w.prefetch_next < w.prefetch.size() && !w.scratch.empty() &&
+             w.free_list.size() > BLK_PREFETCH_RESERVE) {
+        const block::extent &ext = w.prefetch[w.prefetch_next++];
+
+        blk_request *req = w.free_list.back();
+        w.free_list.pop_back();
+        req->scratch = w.scratch.back();
+        w.scratch.pop_back();
+
+        req->type = block::op::read;
+        req->offset = ext.offset;
+        req->iov.assign({{req->scratch, ext.len}});
+        req->extents.clear();
+        req->fua = false;
+        req->result = 0;
+        w.disk->submit(req);
+        issued++;
+      }
+      return issued;
+    }
+
+    // parses the chain and either hands it to the disk or completes it
+    // right away
+    void start(worker &w, blk_request *req) {
+      queue::chain_t &chain = req->chain;
+      req->iov.clear();
+      req->extents.clear();
+      req->result = 0;
+      req->io = false;
+      req->fua = false;
+      req->stat = block::stat_type::other;
+
+      // header, data segments, status
+      req_header hdr;
+      if (iov_to_buf(chain.readable, 0, &hdr, sizeof(hdr)) != sizeof(hdr) || chain.writable.empty()) {
+        fmt::print("kvm::virtio::blk malformed request\n");
+        req->status_offset = 0;
+        req->status = VIRTIO_BLK_S_IOERR;
+        w.immediate.push_back(req);
+        return;
+      }
+
+      req->stat = stat_type(hdr.type);
+      req->status_offset = iov_length(chain.writable) - 1;
+      req->status = chain.truncated ? VIRTIO_BLK_S_IOERR : prepare(req, hdr);
 
-          next = &q().desc()->ring[next->next];
-          *q().translate<__u8>(next->addr) = VIRTIO_BLK_S_OK;
-          len += 1;
+      if (req->status != VIRTIO_BLK_S_OK || !req->io) {
+        w.immediate.push_back(req);
+        return;
+      }
+      req->data_len = iov_length(req->iov);
+      if (recorder && req->type == block::op::read) {
+        recorder->record(req->offset, req->data_len);
+      }
+      w.pending.push_back(req);
+    }
+
+    // hands this round's requests to the disk, folding each run of
+    // sector-contiguous reads or writes into a single vectored io
+    void submit_pending(worker &w) {
+      if (limiter) {
+        admit(w);
+      }
+
+      blk_request *head = nullptr;
+      __u64 head_end = 0;
+
+      const clock::time_point now = clock::now();
+      for (blk_request *req : w.pending) {
+        req->submitted = now;
+        if (head && can_merge(head, head_end, req)) {
+          head->iov.insert(head->iov.end(), req->iov.begin(), req->iov.end());
+          head->merged.push_back(req);
+          head_end += req->data_len;
+          continue;
+        }
+
+        if (head) {
+          w.disk->submit(head);
+        }
+        head = req;
+        head_end = req->offset + req->data_len;
+      }
+
+      if (head) {
+        w.disk->submit(head);
+      }
+      w.pending.clear();
+    }
+
+    // narrows pending down to what the rate limit lets through now. once
+    // one request has to wait everything behind it waits too.
+    void admit(worker &w) {
+      w.throttled.insert(w.throttled.end(), w.pending.begin(), w.pending.end());
+      w.pending.clear();
+
+      while (!w.throttled.empty()) {
+        block::throttle::clock::duration retry;
+        if (!limiter->admit(w.throttled.front()->data_len, retry)) {
+          w.retry_at = block::throttle::clock::now() + retry;
           break;
         }
+        w.pending.push_back(w.throttled.front());
+        w.throttled.pop_front();
+      }
+    }
 
-        default:
-          fmt::print("kvm::virtio::blk unhandled request {}\n", hdr->type);
-          continue;
+    bool can_merge(const blk_request *head, __u64 head_end, const blk_request *req) {
+      if (req->type != head->type || req->fua != head->fua || req->offset != head_end) {
+        return false;
+      }
+      if (req->type != block::op::read && req->type != block::op::write) {
+        return false;
+      }
+      return head->iov.size() + req->iov.size() <= IOV_MAX &&
+             head_end - head->offset + req->data_len <= BLK_MERGE_MAX;
+    }
+
+    // hands every request of a merged io its share of the result, a
+    // short transfer fails the requests past the point it stopped
+    void split_merged(blk_request *head) {
+      __s64 remaining = head->result;
+
+      head->result = remaining < 0 ? remaining : std::min<__s64>(remaining, head->data_len);
+      remaining = remaining < 0 ? remaining : remaining - head->result;
+
+      for (blk_request *part : head->merged) {
+        part->result = remaining < 0 ? remaining : std::min<__s64>(remaining, part->data_len);
+        remaining = remaining < 0 ? remaining : remaining - part->result;
+      }
+    }
+
+    static block::stat_type stat_type(__u32 type) {
+      switch (type) {
+      case VIRTIO_BLK_T_IN:
+        return block::stat_type::read;
+      case VIRTIO_BLK_T_OUT:
+        return block::stat_type::write;
+      case VIRTIO_BLK_T_FLUSH:
+        return block::stat_type::flush;
+      case VIRTIO_BLK_T_DISCARD:
+        return block::stat_type::discard;
+      case VIRTIO_BLK_T_WRITE_ZEROES:
+        return block::stat_type::write_zeroes;
+      default:
+        return block::stat_type::other;
+      }
+    }
+
+    __u8 prepare(blk_request *req, const req_header &hdr) {
+      queue::chain_t &chain = req->chain;
+
+      const bool modifies = hdr.type == VIRTIO_BLK_T_OUT ||
+                            hdr.type == VIRTIO_BLK_T_DISCARD ||
+                            hdr.type == VIRTIO_BLK_T_WRITE_ZEROES;
+      if (modifies && opts.readonly) {
+        return VIRTIO_BLK_S_IOERR;
+      }
+
+      switch (hdr.type) {
+      case VIRTIO_BLK_T_IN:
+        req->type = block::op::read;
+        iov_slice(chain.writable, 0, req->status_offset, req->iov);
+        break;
+
+      case VIRTIO_BLK_T_OUT:
+        req->type = block::op::write;
+        iov_slice(chain.readable, sizeof(req_header), iov_length(chain.readable) - sizeof(req_header), req->iov);
+        req->fua = write_through();
+        break;
+
+      case VIRTIO_BLK_T_FLUSH:
+        req->type = block::op::flush;
+        req->io = true;
+        return VIRTIO_BLK_S_OK;
+
+      case VIRTIO_BLK_T_DISCARD:
+        req->type = block::op::discard;
+        return prepare_extents(req);
+
+      case VIRTIO_BLK_T_WRITE_ZEROES:
+        req->type = block::op::write_zeroes;
+        return prepare_extents(req);
+
+      case VIRTIO_BLK_T_GET_ID: {
+        const size_t len = std::min(req->status_offset, sizeof(DISK_ID));
+        buf_to_iov(chain.writable, 0, DISK_ID, len);
+        req->result = len;
+        return VIRTIO_BLK_S_OK;
+      }
+
+      default:
+        fmt::print("kvm::virtio::blk unhandled request {}\n", hdr.type);
+        return VIRTIO_BLK_S_UNSUPP;
+      }
+
+      req->offset = hdr.sector * 512;
+      if (hdr.sector > capacity || iov_length(req->iov) > disk_size - req->offset) {
+        return VIRTIO_BLK_S_IOERR;
+      }
+      req->io = true;
+      return VIRTIO_BLK_S_OK;
+    }
+
+    // the payload is an array of ranges, each one becomes an extent
+    __u8 prepare_extents(blk_request *req) {
+      const std::vector<iovec> &readable = req->chain.readable;
+      const size_t len = iov_length(readable) - sizeof(req_header);
+      const size_t count = len / sizeof(virtio_blk_discard_write_zeroes);
+      if (len % sizeof(virtio_blk_discard_write_zeroes) || count == 0 || count > BLK_DISCARD_SEG_MAX) {
+        return VIRTIO_BLK_S_IOERR;
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        virtio_blk_discard_write_zeroes range;
+        iov_to_buf(readable, sizeof(req_header) + i * sizeof(range), &range, sizeof(range));
+
+        if (range.sector > capacity || range.num_sectors > capacity - range.sector ||
+            range.num_sectors > BLK_DISCARD_SECTORS_MAX) {
+          return VIRTIO_BLK_S_IOERR;
+        }
+        // unmap is the only flag, and only for write zeroes
+        if (range.flags & ~(req->type == block::op::write_zeroes ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0)) {
+          return VIRTIO_BLK_S_UNSUPP;
         }
 
-        const __u16 idx = q().add_used(desc_start, len);
+        req->extents.push_back({
+            range.sector * 512,
+            __u64(range.num_sectors) * 512,
+            bool(range.flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP),
+        });
+      }
+
+      req->io = true;
+      return VIRTIO_BLK_S_OK;
+    }
+
+    // a driver that did not negotiate FLUSH expects every write to be
+    // stable, one that did may still turn the cache off through wce
+    bool write_through() {
+      if (!(driver_features & (1UL << VIRTIO_BLK_F_FLUSH))) {
+        return true;
+      }
+      return !__atomic_load_n(&config.wce, __ATOMIC_RELAXED);
+    }
 
-        if ((idx - 1) == q().avail()->used_event) {
-          irq->set_level(true);
+    void finish(blk_request *req) {
+      queue::chain_t &chain = req->chain;
+
+      if (req->io) {
+        if (req->result < 0 || __u64(req->result) != req->data_len) {
+          req->status = VIRTIO_BLK_S_IOERR;
         }
       }
+
+      if (chain.writable.empty()) {
+        return;
+      }
+
+      // only reads and get_id put data in front of the status
+      if (req->result > 0 && (!req->io || req->type == block::op::read)) {
+        chain.len += req->result;
+      }
+      buf_to_iov(chain.writable, req->status_offset, &req->status, 1);
+      chain.len += 1;
     }
 
-    void update(__u8 *ptr) override {
+    // sleeps until the driver kicks or the disk completes something
+    void wait(worker &w) {
+      queue &rq = w.rq;
+      struct pollfd fds[2] = {
+          {w.free_list.empty() ? -1 : rq.kick_fd(), POLLIN, 0},
+          {w.disk->event_fd(), POLLIN, 0},
+      };
+      int timeout = 100;
+      if (!w.throttled.empty()) {
+        const auto left = w.retry_at - block::throttle::clock::now();
+        const auto ms = std::chrono::ceil<std::chrono::milliseconds>(left).count();
+        timeout = std::clamp<int>(ms, 0, timeout);
+      }
+
+      if (poll(fds, 2, timeout) <= 0) {
+        return;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        __u64 value = 0;
+        if (::read(rq.kick_fd(), &value, 8) < 0) {
+          // raced with another reader, nothing to do
+        }
+      }
     }
 
-  private:
-    std::fstream file;
+    static void pin(std::thread &thread, int cpu) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0) {
+        fmt::print("kvm::virtio::blk could not pin worker to cpu {}\n", cpu);
+      }
+    }
 
-    virtio_blk_config config;
+    block::options opts;
+    __u64 disk_size;
+    // in sectors, requests are checked against this rather than the
+    // config copy
+    __u64 capacity;
+    std::unique_ptr<block::boot_trace::recorder> recorder;
+    std::unique_ptr<block::throttle> limiter;
+    std::unique_ptr<block::io_trace::writer> tracer;
+    std::vector<std::unique_ptr<worker>> workers;
+
+    virtio_blk_config config = {};
     __u32 generation = 0;
 
+    std::thread stats_thread;
+
     bool should_run = true;
-    std::thread run_thread;
   };
 
 } // namespace kvm::virtio
\ No newline at end of file
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <memory>
 #include <vector>
 
 #include <asm/types.h>
+#include <linux/virtio_config.h>
+
+#include <vring_def.h>
 
 #include "kvm/interrupt.h"
 #include "queue.h"
@@ -32,16 +38,28 @@ namespace kvm::virtio {
     virtual __u32 features() = 0;
     virtual __u32 config_generation() = 0;
 
+    // ring layout features the transport offers on top of features()
+    virtual __u64 transport_features() {
+      return (1ul << VIRTIO_F_VERSION_1) |
+             (1ul << VIRTIO_F_RING_PACKED) |
+             (1ul << VIRTIO_RING_F_INDIRECT_DESC);
+    }
+
     virtual queue &q() = 0;
     virtual queue &q(__u32 index) = 0;
+    virtual __u32 num_queues() = 0;
 
-    virtual void update(__u8 *ptr) = 0;
+    // QUEUE_SEL may name a queue the device does not have, its registers
+    // then read as zero and ignore writes
+    bool queue_selected() {
+      return queue_index < num_queues();
+    }
 
     __u32 read_status() {
       return status;
     }
 
-    void write_status(__u32 update) {
+    virtual void write_status(__u32 update) {
       status = update;
     }
 
@@ -60,17 +78,30 @@ namespace kvm::virtio {
     bool driver_feature_sel = false;
 
   protected:
+    // tells the driver about new used elements on q, through the call
+    // eventfd of a vhost-user frontend if there is one
+    void signal(queue &q) {
+      if (q.call_fd() >= 0) {
+        q.call();
+      } else {
+        irq->set_level(true);
+      }
+    }
+
     ::kvm::interrupt *irq;
     __u8 status = VIRTIO_DEVICE_RESET;
   };
 
+  // queue_count is the most queues the device supports, count the number
+  // it actually exposes
   template <__u32 dev_id, size_t queue_count>
   class queue_device : public device {
   public:
-    queue_device(::kvm::interrupt *irq, __u8 *ptr)
-        : device(irq) {
+    queue_device(::kvm::interrupt *irq, ::kvm::memory_map *mem, __u32 count = queue_count)
+        : device(irq)
+        , count(std::min<__u32>(count, queue_count)) {
       for (size_t i = 0; i < queue_count; i++) {
-        queues[i] = std::make_unique<queue>(ptr);
+        queues[i] = std::make_unique<queue>(mem);
       }
     }
 
@@ -88,11 +119,16 @@ namespace kvm::virtio {
       return *queues[queue_index];
     }
 
+    __u32 num_queues() override {
+      return count;
+    }
+
     __u32 device_id() override {
       return dev_id;
     }
 
   protected:
+    const __u32 count;
     std::array<std::unique_ptr<queue>, queue_count> queues;
   };
 
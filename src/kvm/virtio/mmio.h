@@ -1,5 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
 #include <vector>
 
 #include <fmt/format.h>
@@ -9,8 +13,11 @@
 #include <linux/virtio_ids.h>
 #include <linux/virtio_mmio.h>
 
+#include <vring_def.h>
+
 #include "kvm/device/io_device.h"
 
+#include "device.h"
 #include "queue.h"
 
 namespace kvm::virtio {
@@ -21,7 +28,7 @@ namespace kvm::virtio {
 
     virtual ~mmio_device() {}
 
-    virtual void update(__u8 *ptr) = 0;
+    virtual ::kvm::virtio::device &virtio_device() = 0;
   };
 
   template <class device_type>
@@ -31,13 +38,17 @@ namespace kvm::virtio {
     static constexpr __u32 VIRT_VENDOR = 0x4b544858; // 'KTHX'
 
     template <typename... arg_types>
-    mmio_device_holder(__u64 addr, __u64 width, ::kvm::interrupt *irq, __u8 *ptr, arg_types &&... args)
+    mmio_device_holder(__u64 addr, __u64 width, ::kvm::interrupt *irq, ::kvm::memory_map *mem, arg_types &&... args)
         : mmio_device(addr, width, irq)
-        , dev(irq, ptr, std::forward<arg_types>(args)...) {
+        , dev(irq, mem, std::forward<arg_types>(args)...) {
     }
 
     virtual ~mmio_device_holder() {}
 
+    ::kvm::virtio::device &virtio_device() override {
+      return dev;
+    }
+
     std::vector<__u8> read(__u64 offset, __u32 size) {
       std::vector<__u8> buf(size);
       switch (offset) {
@@ -59,19 +70,19 @@ namespace kvm::virtio {
         break;
 
       case VIRTIO_MMIO_DEVICE_FEATURES: {
-        const __u64 features = __u64(dev.features()) | (1ul << VIRTIO_F_VERSION_1);
+        const __u64 features = __u64(dev.features()) | dev.transport_features();
         const __u32 shift = (dev.device_feature_sel ? 32 : 0);
 
-        *((__u32 *)buf.data()) = (features >> shift) & 0xFFFFFF;
+        *((__u32 *)buf.data()) = (features >> shift) & 0xFFFFFFFF;
         break;
       }
 
       case VIRTIO_MMIO_QUEUE_NUM_MAX:
-        *((__u32 *)buf.data()) = queue::QUEUE_SIZE_MAX;
+        *((__u32 *)buf.data()) = dev.queue_selected() ? queue::QUEUE_SIZE_MAX : 0;
         break;
 
       case VIRTIO_MMIO_QUEUE_READY:
-        *((__u32 *)buf.data()) = dev.q().is_ready() ? 0x1 : 0x0;
+        *((__u32 *)buf.data()) = dev.queue_selected() && dev.q().is_ready() ? 0x1 : 0x0;
         break;
 
       case VIRTIO_MMIO_CONFIG_GENERATION:
@@ -113,6 +124,11 @@ namespace kvm::virtio {
     void write(__u8 *data, __u64 offset, __u32 size) {
       const __u32 value = *((__u32 *)data);
 
+      if (queue_register(offset) && !dev.queue_selected()) {
+        fmt::print("kvm::virtio::mmio write to {:#x} of invalid queue {}\n", offset, dev.queue_index);
+        return;
+      }
+
       switch (offset) {
       case VIRTIO_MMIO_MAGIC_VALUE:
       case VIRTIO_MMIO_VERSION:
@@ -144,18 +160,29 @@ namespace kvm::virtio {
         break;
 
       case VIRTIO_MMIO_QUEUE_SEL:
+        // drivers probe for queues this way, an invalid index is kept
         dev.queue_index = value;
         break;
 
       case VIRTIO_MMIO_QUEUE_NUM:
+        if (value == 0 || value > queue::QUEUE_SIZE_MAX) {
+          fmt::print("kvm::virtio::mmio invalid queue size {}\n", value);
+          break;
+        }
         dev.q().size = value;
         break;
 
       case VIRTIO_MMIO_QUEUE_READY:
+        dev.q().event_idx = dev.driver_features & (1ul << VIRTIO_RING_F_EVENT_IDX);
+        dev.q().packed = dev.driver_features & (1ul << VIRTIO_F_RING_PACKED);
         dev.q().set_ready();
         break;
 
       case VIRTIO_MMIO_QUEUE_NOTIFY:
+        if (value >= dev.num_queues()) {
+          fmt::print("kvm::virtio::mmio notify of invalid queue {}\n", value);
+          break;
+        }
         dev.q(value).set_notify();
         break;
 
@@ -193,11 +220,24 @@ namespace kvm::virtio {
       }
     }
 
-    void update(__u8 *ptr) {
-      dev.update(ptr);
+  private:
+    // registers that configure the queue selected by QUEUE_SEL
+    static bool queue_register(__u64 offset) {
+      switch (offset) {
+      case VIRTIO_MMIO_QUEUE_NUM:
+      case VIRTIO_MMIO_QUEUE_READY:
+      case VIRTIO_MMIO_QUEUE_DESC_LOW:
+      case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+      case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+      case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+      case VIRTIO_MMIO_QUEUE_USED_LOW:
+      case VIRTIO_MMIO_QUEUE_USED_HIGH:
+        return true;
+      default:
+        return false;
+      }
     }
 
-  private:
     device_type dev;
   };
 
@@ -210,42 +250,146 @@ namespace kvm::virtio {
     }
 
     std::vector<__u8> read(__u64 offset, __u32 size) {
-      for (auto &dev : devices) {
-        if (dev->in_range(offset)) {
-          return dev->read(dev->offset(offset), size);
-        }
+      auto r = find(offset);
+      if (r == nullptr) {
+        return {};
       }
-
-      return {};
+      return r->dev->read(offset - r->start, size);
     }
 
     void write(__u8 *data, __u64 offset, __u32 size) {
-      for (auto &dev : devices) {
-        if (dev->in_range(offset)) {
-          return dev->write(data, dev->offset(offset), size);
-        }
-      }
-    }
-
-    void update(__u8 *ptr) {
-      for (auto &dev : devices) {
-        dev->update(ptr);
+      auto r = find(offset);
+      if (r == nullptr) {
+        return;
       }
+      return r->dev->write(data, offset - r->start, size);
     }
 
     template <class device_type, typename... arg_types>
-    void add_device(__u64 addr, __u64 width, ::kvm::interrupt *irq, __u8 *ptr, arg_types &&... args) {
-      devices.emplace_back(new mmio_device_holder<device_type>{
+    mmio_device *add_device(__u64 addr, __u64 width, ::kvm::interrupt *irq, ::kvm::memory_map *mem, arg_types &&... args) {
+      // before the device exists, a rejected one must not start its workers
+      if (overlaps(addr, addr + width))
+        throw std::runtime_error(fmt::format("kvm::virtio::mmio device at {:#x} overlaps existing device", addr));
+
+      auto dev = new mmio_device_holder<device_type>{
           addr,
           width,
           irq,
-          ptr,
+          mem,
           std::forward<arg_types>(args)...,
-      });
+      };
+      devices.emplace_back(dev);
+      publish({addr, addr + width, dev});
+      return dev;
     }
 
   private:
+    // exits are dispatched through a table with one entry per page, so
+    // the lookup does not grow with the number of devices. a layout
+    // spread over more than this falls back to a binary search.
+    static constexpr __u64 PAGE_SHIFT = 12;
+    static constexpr __u64 INDEXED_PAGES_MAX = 1 << 16;
+
+    struct range {
+      __u64 start;
+      __u64 end;
+      mmio_device *dev;
+    };
+
+    // never modified once published
+    struct range_index {
+      // sorted by start, they do not overlap so also by end
+      std::vector<range> ranges;
+      __u64 first_page = 0;
+      // for every page from first_page on, the first range ending past
+      // the start of that page. empty if the layout is too sparse.
+      std::vector<__u32> pages;
+    };
+
+    const range *find(__u64 addr) {
+      const range_index *idx = index.load(std::memory_order_acquire);
+      if (idx == nullptr) {
+        return nullptr;
+      }
+
+      size_t i;
+      if (!idx->pages.empty()) {
+        // below first_page wraps around and misses too
+        const __u64 page = (addr >> PAGE_SHIFT) - idx->first_page;
+        if (page >= idx->pages.size()) {
+          return nullptr;
+        }
+        i = idx->pages[page];
+      } else {
+        i = first_ending_after(idx->ranges, addr);
+      }
+
+      // more than one step only for devices smaller than a page
+      for (; i < idx->ranges.size() && idx->ranges[i].start <= addr; i++) {
+        if (addr < idx->ranges[i].end) {
+          return &idx->ranges[i];
+        }
+      }
+      return nullptr;
+    }
+
+    static size_t first_ending_after(const std::vector<range> &ranges, __u64 addr) {
+      return std::partition_point(ranges.begin(), ranges.end(), [&](const range &r) {
+               return r.end <= addr;
+             }) -
+             ranges.begin();
+    }
+
+    bool overlaps(__u64 start, __u64 end) {
+      const range_index *idx = index.load(std::memory_order_relaxed);
+      if (idx == nullptr) {
+        return false;
+      }
+
+      const size_t i = first_ending_after(idx->ranges, start);
+      return i < idx->ranges.size() && idx->ranges[i].start < end;
+    }
+
+    // builds a new snapshot including r and swaps it in. vcpu threads only
+    // ever load the current snapshot, older ones are kept alive until
+    // the bus is destroyed.
+    void publish(range r) {
+      const range_index *current = index.load(std::memory_order_relaxed);
+
+      auto next = std::make_unique<range_index>();
+      if (current != nullptr) {
+        next->ranges = current->ranges;
+      }
+
+      // add_device already checked r against the current snapshot
+      std::vector<range> &ranges = next->ranges;
+      auto it = std::upper_bound(ranges.begin(), ranges.end(), r.start, [](__u64 addr, const range &r) {
+        return addr < r.start;
+      });
+      ranges.insert(it, r);
+
+      next->first_page = ranges.front().start >> PAGE_SHIFT;
+      const __u64 page_count = ((ranges.back().end - 1) >> PAGE_SHIFT) - next->first_page + 1;
+      if (page_count <= INDEXED_PAGES_MAX) {
+        next->pages.resize(page_count);
+        size_t i = 0;
+        for (__u64 page = 0; page < page_count; page++) {
+          const __u64 page_start = (next->first_page + page) << PAGE_SHIFT;
+          while (ranges[i].end <= page_start) {
+            i++;
+          }
+          next->pages[page] = i;
+        }
+      }
+
+      index.store(next.get(), std::memory_order_release);
+      snapshots.emplace_back(std::move(next));
+    }
+
     std::vector<std::unique_ptr<mmio_device>> devices;
+
+    std::atomic<const range_index *> index{nullptr};
+    std::vector<std::unique_ptr<const range_index>> snapshots;
   };
 
 } // namespace kvm::virtio
\ No newline at end of file
@@ -15,8 +15,10 @@
 #include <net/if.h>
 
 #include <asm/types.h>
+#include <limits.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 extern "C" {
@@ -52,8 +54,8 @@ namespace kvm::virtio {
     static constexpr __u8 tx_queue = 1;
     static constexpr __u8 ctrl_queue = 2;
 
-    net(::kvm::interrupt *irq, __u8 *ptr)
-        : queue_device<VIRTIO_ID_NET, 3>(irq, ptr) {
+    net(::kvm::interrupt *irq, ::kvm::memory_map *mem)
+        : queue_device<VIRTIO_ID_NET, 3>(irq, mem) {
       tap = create_tap("tap0");
       memcpy(config.mac, default_mac, 6);
 
@@ -97,7 +99,8 @@ namespace kvm::virtio {
              1UL << VIRTIO_NET_F_HOST_TSO6 |
              1UL << VIRTIO_NET_F_GUEST_TSO6 |
              1UL << VIRTIO_NET_F_HOST_UFO |
-             1UL << VIRTIO_NET_F_GUEST_UFO;
+             1UL << VIRTIO_NET_F_GUEST_UFO |
+             1UL << VIRTIO_RING_F_EVENT_IDX;
     }
 
     __u32 config_generation() {
@@ -105,93 +108,95 @@ namespace kvm::virtio {
     }
 
     void update_rx(queue &q) {
-      queue::descriptor_elem_t *next = q.next();
-      if (next == nullptr) {
-        std::this_thread::sleep_for(std::chrono::microseconds(10));
-        return;
-      }
-
       if (!::kvm::poll_fd_in(tap, 100)) {
-        q.pop_back();
         return;
       }
 
-      const __u64 buffer_len = 65550 + sizeof(virtio_net_hdr_v1);
-      static __u8 buffer[buffer_len];
+      // fill as many buffers as there are packets waiting
+      size_t count = 0;
+      while (count < queue::QUEUE_SIZE_MAX) {
+        if (count == rx_chains.size()) {
+          rx_chains.emplace_back();
+        }
 
-      ssize_t size = ::read(tap, buffer, buffer_len);
-      if (size < 0) {
-        auto msg = errno_msg("tap read");
-        ioctl_warn("tap read");
-      }
-
-      __u32 len = 0;
-      __u32 written = 0;
-      __u32 desc_start = q.avail_id();
-      while (true) {
-        size_t write_len = std::min(__u32(size - len), next->len);
-        memcpy(q.translate<__u8>(next->addr), buffer + len, write_len);
-        len += write_len;
-
-        if (len == size)
+        queue::chain_t &chain = rx_chains[count];
+        if (!q.next(chain)) {
           break;
+        }
+
+        receive(chain);
+        count++;
 
-        if (!(next->flags & VRING_DESC_F_NEXT))
+        if (!::kvm::poll_fd_in(tap, 0)) {
           break;
+        }
+      }
 
-        next = &q.desc()->ring[next->next];
+      if (count == 0) {
+        // packets pending but no buffers to put them in
+        q.wait_notify(100);
+        return;
       }
 
-      q.add_used(desc_start, len);
-      irq->set_level(true);
+      if (q.add_used_batch(rx_chains, count)) {
+        irq->set_level(true);
+      }
     }
 
-    void update_tx(queue &q) {
-      queue::descriptor_elem_t *next = q.next();
-      if (next == nullptr) {
-        std::this_thread::sleep_for(std::chrono::microseconds(10));
+    // a chain that can not take the packet is still used, with len 0.
+    // handing it back would only get the same head offered again.
+    void receive(queue::chain_t &chain) {
+      chain.len = 0;
+      if (chain.truncated || chain.writable.empty()) {
         return;
       }
 
-      __u32 len = 0;
-      __u32 written = 0;
-      __u32 desc_start = q.avail_id();
+      const int count = std::min<size_t>(chain.writable.size(), IOV_MAX);
+      ssize_t size = ::readv(tap, chain.writable.data(), count);
+      if (size < 0) {
+        ioctl_warn("tap read");
+        return;
+      }
 
-      const __u64 buffer_len = 65550 + sizeof(virtio_net_hdr_v1);
-      static __u8 buffer[buffer_len];
+      chain.len = size;
+    }
 
-      while (true) {
-        memcpy(buffer + written, q.translate<__u8>(next->addr), next->len);
-        written += next->len;
+    void update_tx(queue &q) {
+      const size_t count = q.next_batch(tx_chains, queue::QUEUE_SIZE_MAX);
+      if (count == 0) {
+        q.wait_notify(100);
+        return;
+      }
 
-        if (!(next->flags & VRING_DESC_F_NEXT))
-          break;
+      for (size_t i = 0; i < count; i++) {
+        transmit(tx_chains[i]);
+      }
 
-        next = &q.desc()->ring[next->next];
+      if (q.add_used_batch(tx_chains, count)) {
+        irq->set_level(true);
       }
+    }
 
-      ssize_t ret = ::write(tap, buffer, written);
-      if (ret < 0) {
-        auto msg = errno_msg("tap write");
-        ioctl_warn("tap write");
+    void transmit(queue::chain_t &chain) {
+      if (chain.truncated) {
+        return;
       }
-      len += ret;
 
-      q.add_used(desc_start, len);
-      irq->set_level(true);
+      const int count = std::min<size_t>(chain.readable.size(), IOV_MAX);
+      if (::writev(tap, chain.readable.data(), count) < 0) {
+        ioctl_warn("tap write");
+      }
     }
 
-    void update_ctrl(__u8 *ptr, queue &q) {
-      queue::descriptor_elem_t *next = q.next();
-      if (next == nullptr) {
+    void update_ctrl(queue &q) {
+      queue::chain_t chain;
+      if (!q.next(chain)) {
         return;
       }
 
-      __u32 len = 0;
-      __u32 desc_start = q.avail_id();
-
-      q.add_used(desc_start, len);
-      irq->set_level(true);
+      if (q.add_used(chain)) {
+        irq->set_level(true);
+      }
     }
 
     void run_rx() {
@@ -206,10 +211,6 @@ namespace kvm::virtio {
       }
     }
 
-    void update(__u8 *ptr) {
-      //update_ctrl(ptr, q(ctrl_queue));
-    }
-
   private:
     int create_tap(const char *name) {
       const char *tap_file = "/dev/net/tun";
@@ -247,6 +248,9 @@ namespace kvm::virtio {
 
     bool should_run = true;
 
+    std::vector<queue::chain_t> rx_chains;
+    std::vector<queue::chain_t> tx_chains;
+
     std::thread run_tx_thread;
     std::thread run_rx_thread;
   };
@@ -1,8 +1,21 @@
 #pragma once
 
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <fmt/format.h>
 
 #include <asm/types.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <vring_def.h>
+
+#include "kvm/memory.h"
+#include "kvm/util.h"
 
 #include "barrier.h"
 
@@ -23,11 +36,11 @@ namespace kvm::virtio {
       descriptor_elem_t ring[QUEUE_SIZE_MAX];
     } __attribute__((aligned(16)));
 
+    // used_event follows ring[size], see used_event()
     struct avail_t {
       __u16 flags;
       __u16 idx;
       __u16 ring[QUEUE_SIZE_MAX];
-      __u16 used_event;
     } __attribute__((aligned(2)));
 
     struct used_elem_t {
@@ -35,96 +48,530 @@ namespace kvm::virtio {
       __u32 len;
     };
 
+    // avail_event follows ring[size], see avail_event()
     struct used_t {
       __u16 flags;
       __u16 idx;
       used_elem_t ring[QUEUE_SIZE_MAX];
-      __u16 avail_event;
     } __attribute__((aligned(4)));
 
-    queue(__u8 *ptr)
-        : ptr(ptr) {}
+    // VIRTIO_F_RING_PACKED layout. desc_addr points at the descriptor ring,
+    // avail_addr at the driver and used_addr at the device event suppression.
+    struct packed_elem_t {
+      __u64 addr;
+      __u32 len;
+      __u16 id;
+      __u16 flags;
+    };
+
+    struct packed_t {
+      packed_elem_t ring[QUEUE_SIZE_MAX];
+    } __attribute__((aligned(16)));
+
+    struct event_suppress_t {
+      __u16 off_wrap;
+      __u16 flags;
+    } __attribute__((aligned(4)));
+
+    // a descriptor chain taken off the avail ring, translated to host
+    // memory. parts of buffers outside guest memory are dropped and
+    // flagged as truncated.
+    struct chain_t {
+      __u16 id;    // buffer id, handed back through the used ring
+      __u16 slots; // ring entries the chain occupies
+      __u32 len;   // bytes the device wrote into the chain
 
-    template <class T>
-    inline T *translate(__u64 addr) {
-      return reinterpret_cast<T *>(ptr + addr);
+      std::vector<iovec> readable; // driver to device
+      std::vector<iovec> writable; // device to driver
+      bool truncated;
+    };
+
+    queue(::kvm::memory_map *mem)
+        : mem(mem)
+        , own_kick(eventfd(0, EFD_NONBLOCK))
+        , kick(own_kick) {
+      if (own_kick < 0)
+        throw std::runtime_error(errno_msg("queue eventfd"));
+    }
+
+    ~queue() {
+      close(own_kick);
     }
 
+    // the ring pointers are only valid once the queue is ready
     inline descriptor_t *desc() {
-      return translate<descriptor_t>(desc_addr);
+      return reinterpret_cast<descriptor_t *>(desc_ptr);
     }
 
     inline avail_t *avail() {
-      return translate<avail_t>(avail_addr);
+      return reinterpret_cast<avail_t *>(avail_ptr);
     }
 
     inline used_t *used() {
-      return translate<used_t>(used_addr);
+      return reinterpret_cast<used_t *>(used_ptr);
     }
 
-    inline __u16 avail_id() {
-      return avail()->ring[(last_avail - 1) % size];
+    // written by the driver, the used index it wants an interrupt at
+    inline __u16 *used_event() {
+      return &avail()->ring[size];
     }
 
-    descriptor_elem_t *next() {
-      const std::lock_guard<std::mutex> lock(mu);
-      if (!ready) {
-        return nullptr;
-      }
+    // written by us, the avail index we want a kick at
+    inline __u16 *avail_event() {
+      return reinterpret_cast<__u16 *>(&used()->ring[size]);
+    }
+
+    inline packed_t *packed_desc() {
+      return reinterpret_cast<packed_t *>(desc_ptr);
+    }
+
+    inline event_suppress_t *driver_event() {
+      return reinterpret_cast<event_suppress_t *>(avail_ptr);
+    }
+
+    inline event_suppress_t *device_event() {
+      return reinterpret_cast<event_suppress_t *>(used_ptr);
+    }
+
+    // next(), next_batch(), pop_back() and add_used() may only be called from
+    // the single thread servicing this queue, the driver is the only other party.
+    bool next(chain_t &chain) {
+      return next_batch(&chain, 1) == 1;
+    }
 
-      rmb();
-      if (avail()->idx <= last_avail) {
-        return nullptr;
+    // takes up to limit chains off the avail ring, growing chains as needed.
+    size_t next_batch(std::vector<chain_t> &chains, size_t limit) {
+      if (chains.size() < limit) {
+        chains.resize(limit);
       }
-      last_avail++;
-      return &desc()->ring[avail_id()];
+      return next_batch(chains.data(), limit);
     }
 
+    // puts the last chain returned by next() back onto the avail ring
     void pop_back() {
-      const std::lock_guard<std::mutex> lock(mu);
-      last_avail--;
+      last_avail = prev_avail;
+      avail_wrap = prev_avail_wrap;
     }
 
-    __u16 add_used(__u32 start, __u32 len) {
-      const std::lock_guard<std::mutex> lock(mu);
+    // add_used and add_used_batch return true if the driver asked to be
+    // interrupted for the elements just published
+    bool add_used(const chain_t &chain) {
+      return publish_used(1, [&](size_t) -> const chain_t & { return chain; });
+    }
+
+    // publishes count used elements with a single index update
+    bool add_used_batch(const std::vector<chain_t> &chains, size_t count) {
+      return publish_used(count, [&](size_t i) -> const chain_t & { return chains[i]; });
+    }
+
+    // same for chains completing out of order, e.g. after async io
+    bool add_used_batch(const std::vector<chain_t *> &chains) {
+      return publish_used(chains.size(), [&](size_t i) -> const chain_t & { return *chains[i]; });
+    }
+
+    // true if moving an index from old_idx to new_idx crosses event,
+    // same as vring_need_event in the linux virtio_ring.h
+    static bool need_event(__u16 event, __u16 new_idx, __u16 old_idx) {
+      return __u16(new_idx - event - 1) < __u16(new_idx - old_idx);
+    }
 
-      wmb();
-      used()->ring[used()->idx % size].len = len;
-      used()->ring[used()->idx % size].id = start;
-      used()->idx++;
-      wmb();
-      return used()->idx;
+    // signalled by kvm through an ioeventfd on QUEUE_NOTIFY, or by
+    // set_notify if the write reached userspace
+    int kick_fd() {
+      return kick.load(std::memory_order_relaxed);
     }
 
     void set_notify() {
-      const std::lock_guard<std::mutex> lock(mu);
-      notify++;
+      __u64 value = 0x1;
+      if (::write(kick_fd(), &value, 8) < 0)
+        throw std::runtime_error(errno_msg("queue eventfd write"));
     }
 
-    void set_ready() {
-      const std::lock_guard<std::mutex> lock(mu);
-      ready = true;
+    // a vhost-user backend runs the ring on the kick and call eventfds
+    // its frontend handed over, they stay owned by the caller
+    void set_kick_fd(int fd) {
+      kick.store(fd, std::memory_order_relaxed);
+    }
+
+    void set_call_fd(int fd) {
+      call_eventfd.store(fd, std::memory_order_relaxed);
+    }
+
+    int call_fd() {
+      return call_eventfd.load(std::memory_order_relaxed);
+    }
+
+    void call() {
+      __u64 value = 0x1;
+      if (::write(call_fd(), &value, 8) < 0)
+        throw std::runtime_error(errno_msg("queue call eventfd write"));
+    }
+
+    // blocks until the driver kicks the queue or timeout (ms) passes
+    bool wait_notify(int timeout) {
+      if (!::kvm::poll_fd_in(kick, timeout)) {
+        return false;
+      }
+
+      __u64 value = 0;
+      return ::read(kick, &value, 8) == 8;
+    }
+
+    // publishes size, layout and the ring addresses written before it.
+    // fails if any part of the rings lies outside guest memory.
+    bool set_ready() {
+      if (size == 0 || size > QUEUE_SIZE_MAX) {
+        return false;
+      }
+
+      if (packed) {
+        desc_ptr = mem->translate(desc_addr, sizeof(packed_elem_t) * size);
+        avail_ptr = mem->translate(avail_addr, sizeof(event_suppress_t));
+        used_ptr = mem->translate(used_addr, sizeof(event_suppress_t));
+      } else {
+        desc_ptr = mem->translate(desc_addr, sizeof(descriptor_elem_t) * size);
+        avail_ptr = mem->translate(avail_addr, sizeof(__u16) * (3 + size));
+        used_ptr = mem->translate(used_addr, sizeof(__u16) * 3 + sizeof(used_elem_t) * size);
+      }
+
+      if (desc_ptr == nullptr || avail_ptr == nullptr || used_ptr == nullptr) {
+        fmt::print("kvm::virtio::queue ring outside of guest memory\n");
+        return false;
+      }
+
+      ready.store(true, std::memory_order_release);
+      return true;
     }
 
     bool is_ready() {
-      const std::lock_guard<std::mutex> lock(mu);
-      return ready;
+      return ready.load(std::memory_order_acquire);
+    }
+
+    // no more chains are taken off the ring until set_ready
+    void stop() {
+      ready.store(false, std::memory_order_release);
+    }
+
+    // next avail index, with the wrap counter in bit 15 for packed rings
+    __u16 avail_base() {
+      return packed ? __u16(last_avail | (avail_wrap << 15)) : last_avail;
+    }
+
+    // picks a stopped ring up at base, everything before it has to be
+    // used already. packed must be set first.
+    void set_avail_base(__u16 base) {
+      last_avail = used_idx = prev_avail = packed ? (base & 0x7fff) : base;
+      avail_wrap = used_wrap = prev_avail_wrap = packed ? bool(base >> 15) : true;
+      notify_enabled = true;
     }
 
   public:
     __u32 size = 0;
+    bool event_idx = false;
+    bool packed = false;
 
     __u64 desc_addr = 0;
     __u64 avail_addr = 0;
     __u64 used_addr = 0;
 
   private:
-    __u8 *ptr;
-    std::mutex mu;
+    size_t next_batch(chain_t *chains, size_t limit) {
+      if (!is_ready()) {
+        return 0;
+      }
+
+      if (!has_avail()) {
+        // the caller is about to wait for a kick, ask for one and
+        // check again in case the driver raced with us
+        enable_notify();
+        mb();
+
+        if (!has_avail()) {
+          return 0;
+        }
+      }
+      disable_notify();
+
+      size_t count = 0;
+      while (count < limit && has_avail()) {
+        prev_avail = last_avail;
+        prev_avail_wrap = avail_wrap;
+
+        if (packed) {
+          read_packed_chain(chains[count]);
+        } else {
+          read_chain(chains[count], avail()->ring[last_avail % size]);
+          last_avail++;
+        }
+        count++;
+      }
+      return count;
+    }
+
+    bool has_avail() {
+      if (packed) {
+        // pairs with the drivers store of the head descriptors flags
+        const __u16 flags = load_acquire(&packed_desc()->ring[last_avail].flags);
+        const bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+        const bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+        return avail == avail_wrap && used != avail_wrap;
+      }
+
+      // pairs with the drivers store of avail->idx, making the ring
+      // entries and descriptors it published visible
+      return load_acquire(&avail()->idx) != last_avail;
+    }
+
+    void reset_chain(chain_t &chain) {
+      chain.slots = 0;
+      chain.len = 0;
+      chain.readable.clear();
+      chain.writable.clear();
+      chain.truncated = false;
+    }
+
+    void add_buffer(chain_t &chain, __u64 addr, __u32 len, __u16 flags) {
+      auto &iov = (flags & VRING_DESC_F_WRITE) ? chain.writable : chain.readable;
+      if (mem->to_iovec(addr, len, iov) != len) {
+        chain.truncated = true;
+      }
+    }
+
+    void read_chain(chain_t &chain, __u16 head) {
+      reset_chain(chain);
+      chain.id = head;
+      chain.slots = 1;
+
+      // a chain can not be longer than the ring, this also stops loops.
+      // a head or next outside the ring fails the chain like a loop does.
+      __u16 index = head;
+      for (__u32 i = 0;; i++) {
+        if (i == size || index >= size) {
+          chain.truncated = true;
+          break;
+        }
+
+        const descriptor_elem_t &elem = desc()->ring[index];
+        if (elem.flags & VRING_DESC_F_INDIRECT) {
+          read_indirect(chain, elem.addr, elem.len);
+          break;
+        }
+        add_buffer(chain, elem.addr, elem.len, elem.flags);
+
+        if (!(elem.flags & VRING_DESC_F_NEXT))
+          break;
+        index = elem.next;
+      }
+    }
+
+    // an indirect table replaces the rest of the chain. split tables are
+    // linked through next, packed tables are used in order.
+    void read_indirect(chain_t &chain, __u64 addr, __u32 len) {
+      // both layouts use 16 byte descriptors. a table longer than the
+      // ring is invalid, the chain is failed rather than cut short.
+      const __u32 entries = len / sizeof(descriptor_elem_t);
+      if (entries > size) {
+        chain.truncated = true;
+      }
+      const __u32 count = std::min<__u32>(entries, size);
+      __u8 *host = mem->translate(addr, count * sizeof(descriptor_elem_t));
+      if (host == nullptr) {
+        chain.truncated = true;
+        return;
+      }
+
+      if (packed) {
+        const packed_elem_t *table = reinterpret_cast<const packed_elem_t *>(host);
+        for (__u32 i = 0; i < count; i++) {
+          add_buffer(chain, table[i].addr, table[i].len, table[i].flags);
+        }
+        return;
+      }
+
+      const descriptor_elem_t *table = reinterpret_cast<const descriptor_elem_t *>(host);
+
+      // a next outside the table, or a loop, ends the walk early
+      __u16 index = 0;
+      for (__u32 i = 0;; i++) {
+        if (i == count || index >= count) {
+          chain.truncated = true;
+          break;
+        }
+
+        const descriptor_elem_t &elem = table[index];
+        add_buffer(chain, elem.addr, elem.len, elem.flags);
+
+        if (!(elem.flags & VRING_DESC_F_NEXT))
+          break;
+        index = elem.next;
+      }
+    }
+
+    void read_packed_chain(chain_t &chain) {
+      reset_chain(chain);
+
+      // the rest of the chain is published before the head, which
+      // has_avail already checked
+      for (__u32 i = 0; i < size; i++) {
+        const packed_elem_t &elem = packed_desc()->ring[last_avail];
+        chain.id = elem.id;
+        chain.slots++;
+
+        if (++last_avail == size) {
+          last_avail = 0;
+          avail_wrap = !avail_wrap;
+        }
+
+        if (elem.flags & VRING_DESC_F_INDIRECT) {
+          read_indirect(chain, elem.addr, elem.len);
+          break;
+        }
+        add_buffer(chain, elem.addr, elem.len, elem.flags);
+
+        if (!(elem.flags & VRING_DESC_F_NEXT))
+          break;
+      }
+    }
+
+    // chain(i) returns the i-th chain to publish
+    template <class F>
+    bool publish_used(size_t count, F chain) {
+      if (count == 0) {
+        return false;
+      }
+      if (packed) {
+        return publish_used_packed(count, chain);
+      }
+
+      used_t *u = used();
+      for (size_t i = 0; i < count; i++) {
+        used_elem_t &elem = u->ring[__u16(used_idx + i) % size];
+        elem.id = chain(i).id;
+        elem.len = chain(i).len;
+      }
+
+      const __u16 old_idx = used_idx;
+      used_idx += count;
+
+      // the elements have to be visible before the index moves past them
+      store_release(&u->idx, used_idx);
+
+      // and the index before we look at what the driver wants
+      mb();
+
+      if (event_idx) {
+        return need_event(load_acquire(used_event()), used_idx, old_idx);
+      }
+      return !(load_acquire(&avail()->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    template <class F>
+    bool publish_used_packed(size_t count, F chain) {
+      packed_elem_t *ring = packed_desc()->ring;
+
+      const __u16 old_idx = used_idx;
+      const __u16 head_idx = used_idx;
+      __u16 head_flags = 0;
+
+      for (size_t i = 0; i < count; i++) {
+        packed_elem_t &elem = ring[used_idx];
+        elem.id = chain(i).id;
+        elem.len = chain(i).len;
+
+        const __u16 flags = used_wrap ? PACKED_WRAP_FLAGS : 0;
+        if (i == 0) {
+          head_flags = flags;
+        } else {
+          elem.flags = flags;
+        }
+
+        used_idx += chain(i).slots;
+        if (used_idx >= size) {
+          used_idx -= size;
+          used_wrap = !used_wrap;
+        }
+      }
+
+      // the driver reads used entries in order, flipping the first one
+      // last publishes the whole batch at once
+      store_release(&ring[head_idx].flags, head_flags);
+      mb();
+
+      const event_suppress_t *ev = driver_event();
+      const __u16 ev_flags = load_acquire(&ev->flags);
+      if (ev_flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+      }
+      if (ev_flags != VRING_PACKED_EVENT_FLAG_DESC || !event_idx) {
+        return true;
+      }
+
+      // same as need_event, with the offset and indices unwrapped
+      const __u16 off_wrap = load_acquire(&ev->off_wrap);
+      __u16 off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+      __u16 old = old_idx;
+      if (used_idx <= old) {
+        old -= size;
+      }
+      if (bool(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != used_wrap) {
+        off -= size;
+      }
+      return need_event(off, used_idx, old);
+    }
+
+    // while the ring is being drained the driver does not need to kick.
+    // with event_idx this falls out of avail_event going stale, otherwise
+    // VRING_USED_F_NO_NOTIFY is toggled. packed rings always toggle
+    // the device event suppression flags.
+    void enable_notify() {
+      if (event_idx && !packed) {
+        store_release(avail_event(), last_avail);
+        return;
+      }
+      if (!notify_enabled) {
+        set_notify_flags(false);
+        notify_enabled = true;
+      }
+    }
+
+    void disable_notify() {
+      if ((event_idx && !packed) || !notify_enabled) {
+        return;
+      }
+      set_notify_flags(true);
+      notify_enabled = false;
+    }
+
+    void set_notify_flags(bool suppress) {
+      if (packed) {
+        store_release(&device_event()->flags, __u16(suppress ? VRING_PACKED_EVENT_FLAG_DISABLE : VRING_PACKED_EVENT_FLAG_ENABLE));
+      } else {
+        store_release(&used()->flags, __u16(suppress ? VRING_USED_F_NO_NOTIFY : 0));
+      }
+    }
+
+    static constexpr __u16 PACKED_WRAP_FLAGS = (1 << VRING_PACKED_DESC_F_AVAIL) | (1 << VRING_PACKED_DESC_F_USED);
+
+    ::kvm::memory_map *mem;
+    __u8 *desc_ptr = nullptr;
+    __u8 *avail_ptr = nullptr;
+    __u8 *used_ptr = nullptr;
+
+    int own_kick;
+    std::atomic_int kick;
+    std::atomic_int call_eventfd = -1;
+    __u16 last_avail = 0;
+    __u16 used_idx = 0;
+    bool notify_enabled = true;
+
+    // packed ring wrap counters, both start out set
+    bool avail_wrap = true;
+    bool used_wrap = true;
 
-    __u64 notify = 0;
-    __u32 last_avail = 0;
-    bool ready = false;
+    // where the last chain started, for pop_back
+    __u16 prev_avail = 0;
+    bool prev_avail_wrap = true;
+    std::atomic_bool ready = false;
   };
 
 } // namespace kvm::virtio
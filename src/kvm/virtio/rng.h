@@ -1,5 +1,7 @@
 #pragma once
 
+#include <fstream>
+#include <thread>
 #include <vector>
 
 #include <fmt/format.h>
@@ -13,11 +15,18 @@ namespace kvm::virtio {
 
   class rng : public queue_device<VIRTIO_ID_RNG, 1> {
   public:
-    rng(::kvm::interrupt *irq, __u8 *ptr)
-        : queue_device<VIRTIO_ID_RNG, 1>(irq, ptr)
+    rng(::kvm::interrupt *irq, ::kvm::memory_map *mem)
+        : queue_device<VIRTIO_ID_RNG, 1>(irq, mem)
         , file("/dev/random") {
       if (!file.is_open())
         throw std::runtime_error(fmt::format("could not open file {}", "/dev/random"));
+
+      run_thread = std::thread(&rng::run, this);
+    }
+
+    ~rng() {
+      should_run = false;
+      run_thread.join();
     }
 
     std::vector<__u8> read(__u64 offset, __u32 size) {
@@ -31,31 +40,43 @@ namespace kvm::virtio {
     }
 
     __u32 features() {
-      return 0;
+      return 1UL << VIRTIO_RING_F_EVENT_IDX;
     }
 
     __u32 config_generation() {
       return 0;
     }
 
-    void update(__u8 *ptr) {
-      queue::descriptor_elem_t *next = q().next();
-      if (next == nullptr) {
-        return;
+    void run() {
+      queue &rq = q(0);
+      std::vector<queue::chain_t> chains;
+
+      while (should_run) {
+        const size_t count = rq.next_batch(chains, queue::QUEUE_SIZE_MAX);
+        if (count == 0) {
+          rq.wait_notify(100);
+          continue;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+          queue::chain_t &chain = chains[i];
+          for (const auto &buf : chain.writable) {
+            file.read(reinterpret_cast<char *>(buf.iov_base), buf.iov_len);
+            chain.len += buf.iov_len;
+          }
+        }
+
+        if (rq.add_used_batch(chains, count)) {
+          irq->set_level(true);
+        }
       }
-
-      __u32 len = 0;
-      __u32 desc_start = q().avail_id();
-
-      file.read((char *)(ptr + next->addr), next->len);
-      len += next->len;
-
-      q().add_used(desc_start, len);
-      irq->set_level(true);
     }
 
   private:
     std::ifstream file;
+
+    bool should_run = true;
+    std::thread run_thread;
   };
 
 } // namespace kvm::virtio
\ No newline at end of file
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <asm/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kvm/util.h"
+
+// the vhost-user protocol, a frontend hands a backend process the guest
+// memory and the rings of a virtio device over a unix socket
+namespace kvm::virtio::vhost_user {
+
+  enum request : __u32 {
+    GET_FEATURES = 1,
+    SET_FEATURES = 2,
+    SET_OWNER = 3,
+    RESET_OWNER = 4,
+    SET_MEM_TABLE = 5,
+    SET_LOG_BASE = 6,
+    SET_LOG_FD = 7,
+    SET_VRING_NUM = 8,
+    SET_VRING_ADDR = 9,
+    SET_VRING_BASE = 10,
+    GET_VRING_BASE = 11,
+    SET_VRING_KICK = 12,
+    SET_VRING_CALL = 13,
+    SET_VRING_ERR = 14,
+    GET_PROTOCOL_FEATURES = 15,
+    SET_PROTOCOL_FEATURES = 16,
+    GET_QUEUE_NUM = 17,
+    SET_VRING_ENABLE = 18,
+    GET_CONFIG = 24,
+    SET_CONFIG = 25,
+  };
+
+  constexpr __u32 VERSION = 0x1;
+  constexpr __u32 FLAG_VERSION_MASK = 0x3;
+  constexpr __u32 FLAG_REPLY = 1 << 2;
+  constexpr __u32 FLAG_NEED_REPLY = 1 << 3;
+
+  // virtio feature bit that announces the protocol features
+  constexpr __u64 F_PROTOCOL_FEATURES = 1ull << 30;
+
+  constexpr __u64 PROTOCOL_F_MQ = 1ull << 0;
+  constexpr __u64 PROTOCOL_F_REPLY_ACK = 1ull << 3;
+  constexpr __u64 PROTOCOL_F_CONFIG = 1ull << 9;
+
+  // SET_VRING_KICK and CALL carry the ring index and this flag instead
+  // of a file descriptor
+  constexpr __u64 VRING_INDEX_MASK = 0xff;
+  constexpr __u64 VRING_NOFD = 1 << 8;
+
+  constexpr size_t MAX_REGIONS = 8;
+  constexpr size_t MAX_FDS = 8;
+  constexpr size_t MAX_PAYLOAD = 4096;
+
+  struct header {
+    __u32 request;
+    __u32 flags;
+    __u32 size;
+  };
+
+  struct vring_state {
+    __u32 index;
+    __u32 num;
+  };
+
+  // ring addresses in the frontend's address space
+  struct vring_addr {
+    __u32 index;
+    __u32 flags;
+    __u64 desc;
+    __u64 used;
+    __u64 avail;
+    __u64 log;
+  };
+
+  struct region {
+    __u64 guest_addr;
+    __u64 size;
+    __u64 user_addr;
+    __u64 mmap_offset;
+  };
+
+  struct mem_table {
+    __u32 count;
+    __u32 padding;
+    region regions[MAX_REGIONS];
+  };
+
+  // followed by size bytes of device config space
+  struct config_header {
+    __u32 offset;
+    __u32 size;
+    __u32 flags;
+  };
+
+  struct message {
+    header hdr;
+    std::vector<__u8> payload;
+    std::vector<int> fds;
+
+    template <class T>
+    T get() const {
+      T value = {};
+      memcpy(&value, payload.data(), std::min(sizeof(T), payload.size()));
+      return value;
+    }
+  };
+
+  // one end of the unix socket, messages carry file descriptors as
+  // SCM_RIGHTS
+  class channel {
+  public:
+    explicit channel(int fd)
+        : fd(fd) {}
+
+    ~channel() {
+      close(fd);
+    }
+
+    static int connect_to(const std::string &path) {
+      struct sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error(fmt::format("vhost-user socket path {} is too long", path));
+      memcpy(addr.sun_path, path.c_str(), path.size());
+
+      const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+        throw std::runtime_error(errno_msg("socket"));
+      if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        const std::string msg = errno_msg(fmt::format("connect {}", path));
+        close(fd);
+        throw std::runtime_error(msg);
+      }
+      return fd;
+    }
+
+    void send(__u32 req, __u32 flags, const void *payload, size_t size, const std::vector<int> &fds = {}) {
+      std::vector<__u8> buf(sizeof(header) + size);
+      const header hdr = {req, flags | VERSION, __u32(size)};
+      memcpy(buf.data(), &hdr, sizeof(hdr));
+      if (size) {
+        memcpy(buf.data() + sizeof(hdr), payload, size);
+      }
+
+      struct iovec iov = {buf.data(), buf.size()};
+      struct msghdr msg = {};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+
+      char control[CMSG_SPACE(sizeof(int) * MAX_FDS)] = {};
+      if (!fds.empty()) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+      }
+
+      ssize_t n;
+      do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+      } while (n < 0 && errno == EINTR);
+      if (n != ssize_t(buf.size()))
+        throw std::runtime_error(errno_msg("vhost-user send"));
+    }
+
+    void send_u64(__u32 req, __u64 value, const std::vector<int> &fds = {}) {
+      send(req, 0, &value, sizeof(value), fds);
+    }
+
+    void send_state(__u32 req, __u32 index, __u32 num) {
+      const vring_state state = {index, num};
+      send(req, 0, &state, sizeof(state));
+    }
+
+    // false once the other end has gone away
+    bool recv(message &msg) {
+      msg.fds.clear();
+
+      struct iovec iov = {&msg.hdr, sizeof(msg.hdr)};
+      struct msghdr mh = {};
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof(control);
+
+      ssize_t n;
+      do {
+        n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+      } while (n < 0 && errno == EINTR);
+      if (n == 0) {
+        return false;
+      }
+      if (n != sizeof(msg.hdr))
+        throw std::runtime_error(errno_msg("vhost-user recv"));
+
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+          const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+          const int *fds = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+          msg.fds.insert(msg.fds.end(), fds, fds + count);
+        }
+      }
+
+      if (msg.hdr.size > MAX_PAYLOAD)
+        throw std::runtime_error(fmt::format("vhost-user message of {} bytes", msg.hdr.size));
+      msg.payload.resize(msg.hdr.size);
+      if (msg.hdr.size) {
+        do {
+          n = ::recv(fd, msg.payload.data(), msg.payload.size(), MSG_WAITALL);
+        } while (n < 0 && errno == EINTR);
+        if (n != ssize_t(msg.payload.size()))
+          throw std::runtime_error(errno_msg("vhost-user recv"));
+      }
+      return true;
+    }
+
+    // sends a request and waits for the reply to it
+    message call(__u32 req, const void *payload = nullptr, size_t size = 0) {
+      send(req, 0, payload, size);
+
+      message reply;
+      if (!recv(reply))
+        throw std::runtime_error("vhost-user backend went away");
+      if (reply.hdr.request != req || !(reply.hdr.flags & FLAG_REPLY))
+        throw std::runtime_error(fmt::format("vhost-user backend sent {} in reply to {}", reply.hdr.request, req));
+      return reply;
+    }
+
+    void reply(const message &req, const void *payload, size_t size) {
+      send(req.hdr.request, FLAG_REPLY, payload, size);
+    }
+
+  private:
+    int fd;
+  };
+
+} // namespace kvm::virtio::vhost_user
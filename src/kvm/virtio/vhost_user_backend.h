@@ -0,0 +1,311 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <asm/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "kvm/block/options.h"
+#include "kvm/interrupt.h"
+#include "kvm/memory.h"
+#include "kvm/util.h"
+
+#include "blk.h"
+#include "vhost_user.h"
+
+namespace kvm::virtio {
+
+  // serves one vhost-user frontend with a virtio::blk. the frontends
+  // guest memory is mapped into this process and the rings are run by
+  // the usual blk workers, which take kicks from and signal completions
+  // through the eventfds the frontend hands over.
+  class vhost_user_blk_backend {
+  public:
+    vhost_user_blk_backend(int fd, block::options options)
+        : chan(fd)
+        , opts(options)
+        , irq(0) {
+      dev = std::make_unique<blk>(&irq, &mem, opts);
+    }
+
+    ~vhost_user_blk_backend() {
+      // the workers go first, they still use the rings and eventfds
+      dev.reset();
+
+      for (auto &r : rings) {
+        close(r.kick);
+        close(r.call);
+        close_retired(r);
+      }
+      for (auto &m : mappings) {
+        munmap(m.addr, m.size);
+      }
+    }
+
+    // handles messages until the frontend disconnects
+    void run() {
+      vhost_user::message msg;
+      while (chan.recv(msg)) {
+        handle(msg);
+        for (int fd : msg.fds) {
+          close(fd);
+        }
+      }
+    }
+
+  private:
+    struct ring {
+      __u32 num = 0;
+      vhost_user::vring_addr addr = {};
+      __u16 base = 0;
+      int kick = -1;
+      int call = -1;
+      // replaced eventfds the worker may still be using, closed once
+      // the ring is quiesced
+      std::vector<int> retired;
+      bool enabled = false;
+      bool started = false;
+    };
+
+    struct mapping {
+      void *addr;
+      size_t size;
+    };
+
+    // fds the handler keeps are taken out of msg.fds, the rest is closed
+    void handle(vhost_user::message &msg) {
+      switch (msg.hdr.request) {
+      case vhost_user::GET_FEATURES: {
+        const __u64 features = __u64(dev->features()) | dev->transport_features() | vhost_user::F_PROTOCOL_FEATURES;
+        chan.reply(msg, &features, sizeof(features));
+        break;
+      }
+
+      case vhost_user::SET_FEATURES:
+        dev->driver_features = msg.get<__u64>() & ~vhost_user::F_PROTOCOL_FEATURES;
+        break;
+
+      case vhost_user::GET_PROTOCOL_FEATURES: {
+        const __u64 features = vhost_user::PROTOCOL_F_MQ | vhost_user::PROTOCOL_F_CONFIG;
+        chan.reply(msg, &features, sizeof(features));
+        break;
+      }
+
+      case vhost_user::GET_QUEUE_NUM: {
+        const __u64 queues = dev->num_queues();
+        chan.reply(msg, &queues, sizeof(queues));
+        break;
+      }
+
+      case vhost_user::SET_OWNER:
+        break;
+
+      case vhost_user::SET_PROTOCOL_FEATURES:
+        protocol_features = msg.get<__u64>() & (vhost_user::PROTOCOL_F_MQ | vhost_user::PROTOCOL_F_CONFIG);
+        break;
+
+      case vhost_user::SET_MEM_TABLE:
+        set_mem_table(msg);
+        break;
+
+      case vhost_user::SET_VRING_NUM: {
+        const auto state = msg.get<vhost_user::vring_state>();
+        ring_at(state.index).num = state.num;
+        break;
+      }
+
+      case vhost_user::SET_VRING_ADDR: {
+        const auto addr = msg.get<vhost_user::vring_addr>();
+        ring_at(addr.index).addr = addr;
+        break;
+      }
+
+      case vhost_user::SET_VRING_BASE: {
+        const auto state = msg.get<vhost_user::vring_state>();
+        ring_at(state.index).base = state.num;
+        break;
+      }
+
+      case vhost_user::GET_VRING_BASE: {
+        const auto state = msg.get<vhost_user::vring_state>();
+        ring &r = ring_at(state.index);
+        queue &rq = dev->q(state.index);
+
+        // the worker completes what it took off the ring before the base
+        // is read, the frontend may reuse the ring right after the reply
+        dev->quiesce(state.index);
+        r.started = false;
+        r.enabled = false;
+        close_retired(r);
+
+        const vhost_user::vring_state reply = {state.index, rq.avail_base()};
+        chan.reply(msg, &reply, sizeof(reply));
+        break;
+      }
+
+      case vhost_user::SET_VRING_KICK:
+      case vhost_user::SET_VRING_CALL: {
+        const __u64 value = msg.get<__u64>();
+        const __u32 index = value & vhost_user::VRING_INDEX_MASK;
+        ring &r = ring_at(index);
+
+        int fd = -1;
+        if (!(value & vhost_user::VRING_NOFD)) {
+          if (msg.fds.empty())
+            throw std::runtime_error("vhost-user vring eventfd missing");
+          fd = msg.fds.back();
+          msg.fds.pop_back();
+        }
+
+        if (msg.hdr.request == vhost_user::SET_VRING_KICK) {
+          // polling rings are not supported, the workers wait on the kick
+          if (fd < 0)
+            throw std::runtime_error("vhost-user ring without a kick eventfd");
+          dev->q(index).set_kick_fd(fd);
+          retire(r, r.kick);
+          r.kick = fd;
+          start(index);
+        } else {
+          dev->q(index).set_call_fd(fd);
+          retire(r, r.call);
+          r.call = fd;
+        }
+        break;
+      }
+
+      case vhost_user::SET_VRING_ENABLE: {
+        const auto state = msg.get<vhost_user::vring_state>();
+        ring_at(state.index).enabled = state.num;
+        start(state.index);
+        break;
+      }
+
+      case vhost_user::GET_CONFIG: {
+        const auto hdr = msg.get<vhost_user::config_header>();
+        const std::vector<__u8> config = dev->read(hdr.offset, hdr.size);
+
+        std::vector<__u8> reply(sizeof(hdr) + config.size());
+        memcpy(reply.data(), &hdr, sizeof(hdr));
+        memcpy(reply.data() + sizeof(hdr), config.data(), config.size());
+        chan.reply(msg, reply.data(), reply.size());
+        break;
+      }
+
+      case vhost_user::SET_CONFIG: {
+        const auto hdr = msg.get<vhost_user::config_header>();
+        if (sizeof(hdr) + hdr.size > msg.payload.size())
+          throw std::runtime_error("vhost-user SET_CONFIG is short");
+        // the frontend may only flip the write cache, like a driver
+        if (!(protocol_features & vhost_user::PROTOCOL_F_CONFIG) ||
+            hdr.offset != offsetof(virtio_blk_config, wce) || hdr.size != 1) {
+          fmt::print("kvm::virtio::vhost_user_blk_backend refused config write at {:#x}\n", hdr.offset);
+          break;
+        }
+        dev->write(msg.payload.data() + sizeof(hdr), hdr.offset, hdr.size);
+        break;
+      }
+
+      default:
+        fmt::print("kvm::virtio::vhost_user_blk_backend unhandled request {}\n", msg.hdr.request);
+        break;
+      }
+    }
+
+    void retire(ring &r, int fd) {
+      if (fd >= 0) {
+        r.retired.push_back(fd);
+      }
+    }
+
+    void close_retired(ring &r) {
+      for (int fd : r.retired) {
+        close(fd);
+      }
+      r.retired.clear();
+    }
+
+    ring &ring_at(__u32 index) {
+      if (index >= dev->num_queues())
+        throw std::runtime_error(fmt::format("vhost-user ring {} out of range", index));
+      return rings[index];
+    }
+
+    void set_mem_table(vhost_user::message &msg) {
+      // the workers translate without locking, the table can not change
+      // under them
+      if (!regions.empty())
+        throw std::runtime_error("vhost-user guest memory can only be set once");
+
+      const auto table = msg.get<vhost_user::mem_table>();
+      if (table.count > vhost_user::MAX_REGIONS || table.count != msg.fds.size())
+        throw std::runtime_error("vhost-user memory table does not match its fds");
+
+      for (__u32 i = 0; i < table.count; i++) {
+        const vhost_user::region &r = table.regions[i];
+        const size_t size = r.size + r.mmap_offset;
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, msg.fds[i], 0);
+        if (addr == MAP_FAILED)
+          throw std::runtime_error(errno_msg("vhost-user guest memory mmap"));
+
+        mappings.push_back({addr, size});
+        regions.push_back(r);
+        mem.add_region(r.guest_addr, r.size, static_cast<__u8 *>(addr) + r.mmap_offset);
+      }
+    }
+
+    // frontend address to guest physical, the rings are described in
+    // the frontends address space
+    __u64 to_guest(__u64 user_addr) {
+      for (const auto &r : regions) {
+        if (user_addr >= r.user_addr && user_addr - r.user_addr < r.size) {
+          return r.guest_addr + (user_addr - r.user_addr);
+        }
+      }
+      throw std::runtime_error(fmt::format("vhost-user ring address {:#x} outside guest memory", user_addr));
+    }
+
+    // a ring runs once it has a kick eventfd and was enabled
+    void start(__u32 index) {
+      ring &r = rings[index];
+      if (r.started || r.kick < 0 || !r.enabled) {
+        return;
+      }
+
+      queue &rq = dev->q(index);
+      rq.size = r.num;
+      rq.event_idx = dev->driver_features & (1ul << VIRTIO_RING_F_EVENT_IDX);
+      rq.packed = dev->driver_features & (1ul << VIRTIO_F_RING_PACKED);
+      rq.desc_addr = to_guest(r.addr.desc);
+      rq.avail_addr = to_guest(r.addr.avail);
+      rq.used_addr = to_guest(r.addr.used);
+      rq.set_avail_base(r.base);
+      if (!rq.set_ready())
+        throw std::runtime_error(fmt::format("vhost-user ring {} is invalid", index));
+
+      dev->resume(index);
+      r.started = true;
+    }
+
+    vhost_user::channel chan;
+    block::options opts;
+    // what the frontend accepted of GET_PROTOCOL_FEATURES
+    __u64 protocol_features = 0;
+
+    // nothing is signalled through it, completions go to the call eventfds
+    ::kvm::interrupt irq;
+    ::kvm::memory_map mem;
+    std::vector<vhost_user::region> regions;
+    std::vector<mapping> mappings;
+
+    std::array<ring, BLK_QUEUES_MAX> rings;
+    std::unique_ptr<blk> dev;
+  };
+
+} // namespace kvm::virtio
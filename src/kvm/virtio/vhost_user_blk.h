@@ -0,0 +1,231 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <asm/types.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <linux/virtio_blk.h>
+#include <linux/virtio_ids.h>
+
+#include "kvm/util.h"
+
+#include "blk.h"
+#include "device.h"
+#include "vhost_user.h"
+
+namespace kvm::virtio {
+
+  // a block device served by a vhost-user backend process. the mmio
+  // transport stays here, the backend maps guest memory, takes kicks
+  // straight from the queue ioeventfds and signals completions through
+  // a call eventfd, which raises the interrupt line.
+  class vhost_user_blk : public queue_device<VIRTIO_ID_BLOCK, BLK_QUEUES_MAX> {
+  public:
+    // socket is the path of the backend's unix socket
+    vhost_user_blk(::kvm::interrupt *irq, ::kvm::memory_map *mem, std::string socket)
+        : vhost_user_blk(irq, mem, connect(socket)) {}
+
+    ~vhost_user_blk() {
+      should_run = false;
+      call_thread.join();
+      close(call);
+    }
+
+    std::vector<__u8> read(__u64 offset, __u32 size) {
+      std::vector<__u8> buf(size);
+
+      if ((offset + size) > sizeof(virtio_blk_config)) {
+        fmt::print("kvm::virtio::vhost_user_blk invalid config read at {:#x}\n", offset);
+        return buf;
+      }
+
+      memcpy(buf.data(), (uint8_t *)(&config) + offset, size);
+      return buf;
+    }
+
+    // only wce is writable, the backend refuses anything else too
+    void write(__u8 *data, __u64 offset, __u32 size) {
+      if (offset != offsetof(virtio_blk_config, wce) || size != 1 || data[0] > 1) {
+        fmt::print("kvm::virtio::vhost_user_blk invalid config write at {:#x}\n", offset);
+        return;
+      }
+
+      memcpy((uint8_t *)(&config) + offset, data, size);
+      generation++;
+
+      std::vector<__u8> msg(sizeof(vhost_user::config_header) + size);
+      const vhost_user::config_header hdr = {__u32(offset), size, 0};
+      memcpy(msg.data(), &hdr, sizeof(hdr));
+      memcpy(msg.data() + sizeof(hdr), data, size);
+      chan->send(vhost_user::SET_CONFIG, 0, msg.data(), msg.size());
+    }
+
+    __u32 features() {
+      return backend_features & 0xffffffff & ~vhost_user::F_PROTOCOL_FEATURES;
+    }
+
+    // only what the backend can run
+    __u64 transport_features() {
+      return device::transport_features() & backend_features;
+    }
+
+    __u32 config_generation() {
+      return generation;
+    }
+
+    // the rings are handed over once the driver is done setting them up,
+    // and taken back on reset
+    void write_status(__u32 update) {
+      const bool driver_ok = update & VIRTIO_DEVICE_DRIVER_OK;
+      if (driver_ok && !started) {
+        start();
+      } else if (update == VIRTIO_DEVICE_RESET && started) {
+        stop();
+      }
+      status = update;
+    }
+
+  private:
+    // what the backend offered, negotiated before the queues exist
+    struct backend {
+      std::unique_ptr<vhost_user::channel> chan;
+      __u64 features;
+      __u32 queues;
+    };
+
+    vhost_user_blk(::kvm::interrupt *irq, ::kvm::memory_map *mem, backend b)
+        : queue_device<VIRTIO_ID_BLOCK, BLK_QUEUES_MAX>(irq, mem, b.queues)
+        , chan(std::move(b.chan))
+        , backend_features(b.features)
+        , call(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+      if (call < 0)
+        throw std::runtime_error(errno_msg("vhost-user call eventfd"));
+
+      const vhost_user::config_header hdr = {0, sizeof(config), 0};
+      std::vector<__u8> msg(sizeof(hdr) + sizeof(config));
+      memcpy(msg.data(), &hdr, sizeof(hdr));
+      const vhost_user::message reply = chan->call(vhost_user::GET_CONFIG, msg.data(), msg.size());
+      if (reply.payload.size() < sizeof(hdr) + sizeof(config))
+        throw std::runtime_error("vhost-user backend sent a short config");
+      memcpy(&config, reply.payload.data() + sizeof(hdr), sizeof(config));
+
+      send_mem_table(*mem);
+      call_thread = std::thread(&vhost_user_blk::run_call, this);
+
+      fmt::print("kvm::virtio::vhost_user_blk {} queues, capacity {} sectors\n", num_queues(), __u64(config.capacity));
+    }
+
+    static backend connect(const std::string &socket) {
+      backend b = {std::make_unique<vhost_user::channel>(vhost_user::channel::connect_to(socket)), 0, 1};
+      vhost_user::channel &chan = *b.chan;
+      chan.send(vhost_user::SET_OWNER, 0, nullptr, 0);
+
+      b.features = chan.call(vhost_user::GET_FEATURES).get<__u64>();
+      if (!(b.features & vhost_user::F_PROTOCOL_FEATURES))
+        throw std::runtime_error("vhost-user backend has no protocol features");
+
+      // the config space is needed, it is where the capacity comes from
+      const __u64 offered = chan.call(vhost_user::GET_PROTOCOL_FEATURES).get<__u64>();
+      const __u64 protocol_features = offered & (vhost_user::PROTOCOL_F_MQ | vhost_user::PROTOCOL_F_CONFIG);
+      if (!(protocol_features & vhost_user::PROTOCOL_F_CONFIG))
+        throw std::runtime_error("vhost-user backend does not share its config space");
+      chan.send_u64(vhost_user::SET_PROTOCOL_FEATURES, protocol_features);
+
+      if ((protocol_features & vhost_user::PROTOCOL_F_MQ) && (b.features & (1ul << VIRTIO_BLK_F_MQ))) {
+        b.queues = std::clamp<__u64>(chan.call(vhost_user::GET_QUEUE_NUM).get<__u64>(), 1, BLK_QUEUES_MAX);
+      }
+      return b;
+    }
+
+    void send_mem_table(::kvm::memory_map &mem) {
+      vhost_user::mem_table table = {};
+      std::vector<int> fds;
+      for (const auto &r : mem.get_regions()) {
+        if (r.fd < 0)
+          throw std::runtime_error("vhost-user needs guest memory backed by a file");
+        if (table.count == vhost_user::MAX_REGIONS)
+          throw std::runtime_error("too many memory regions for vhost-user");
+
+        table.regions[table.count++] = {r.guest_addr, r.size, reinterpret_cast<__u64>(r.host), r.fd_offset};
+        fds.push_back(r.fd);
+      }
+
+      const size_t size = offsetof(vhost_user::mem_table, regions) + table.count * sizeof(vhost_user::region);
+      chan->send(vhost_user::SET_MEM_TABLE, 0, &table, size, fds);
+    }
+
+    void start() {
+      chan->send_u64(vhost_user::SET_FEATURES, (driver_features & backend_features) | vhost_user::F_PROTOCOL_FEATURES);
+
+      for (__u32 i = 0; i < num_queues(); i++) {
+        queue &rq = q(i);
+        if (!rq.is_ready()) {
+          continue;
+        }
+
+        const vhost_user::vring_addr addr = {
+            i,
+            0,
+            reinterpret_cast<__u64>(rq.desc()),
+            reinterpret_cast<__u64>(rq.used()),
+            reinterpret_cast<__u64>(rq.avail()),
+            0,
+        };
+        chan->send_state(vhost_user::SET_VRING_NUM, i, rq.size);
+        chan->send(vhost_user::SET_VRING_ADDR, 0, &addr, sizeof(addr));
+        chan->send_state(vhost_user::SET_VRING_BASE, i, rq.avail_base());
+        chan->send_u64(vhost_user::SET_VRING_KICK, i, {rq.kick_fd()});
+        // one call eventfd for all rings, the mmio transport has a
+        // single interrupt line anyway
+        chan->send_u64(vhost_user::SET_VRING_CALL, i, {call});
+        chan->send_state(vhost_user::SET_VRING_ENABLE, i, 1);
+      }
+      started = true;
+    }
+
+    void stop() {
+      for (__u32 i = 0; i < num_queues(); i++) {
+        if (q(i).is_ready()) {
+          const vhost_user::vring_state state = {i, 0};
+          chan->call(vhost_user::GET_VRING_BASE, &state, sizeof(state));
+        }
+      }
+      started = false;
+    }
+
+    void run_call() {
+      while (should_run) {
+        if (!::kvm::poll_fd_in(call, 100)) {
+          continue;
+        }
+
+        __u64 value = 0;
+        if (::read(call, &value, 8) == 8) {
+          irq->set_level(true);
+        }
+      }
+    }
+
+    std::unique_ptr<vhost_user::channel> chan;
+    const __u64 backend_features;
+
+    int call;
+    std::thread call_thread;
+
+    virtio_blk_config config = {};
+    __u32 generation = 0;
+
+    bool started = false;
+    std::atomic_bool should_run = true;
+  };
+
+} // namespace kvm::virtio
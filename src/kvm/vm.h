@@ -1,22 +1,30 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <memory>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <fmt/format.h>
 
 #include <fcntl.h>
 #include <linux/kvm.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "interrupt.h"
 #include "kvm.h"
 #include "layout.h"
+#include "memory.h"
 #include "vcpu.h"
 
+#include "device/io_sink.h"
+
 #include "virtio/mmio.h"
 
 namespace kvm {
@@ -29,10 +37,16 @@ namespace kvm {
   static constexpr __u64 KVM_32BIT_GAP_SIZE = (768 << 20);
   static constexpr __u64 KVM_32BIT_GAP_START = (KVM_32BIT_MAX_MEM_SIZE - KVM_32BIT_GAP_SIZE);
 
+  static constexpr __u64 IO_PORT_COUNT = 0x10000;
+
   class vm {
   public:
-    vm(kvm &k, int ncpus, size_t mem)
+    // shared_memory backs guest memory with a memfd, which vhost-user
+    // backends need to map it
+    vm(kvm &k, int ncpus, size_t mem, bool shared_memory = false)
         : fd(k.create_vm())
+        , unhandled_io(0, IO_PORT_COUNT, nullptr, true)
+        , io_ports(IO_PORT_COUNT, &unhandled_io)
         , mmio(new virtio::mmio()) {
 
       if (fd < 0)
@@ -40,27 +54,50 @@ namespace kvm {
 
       fmt::print("vm: open with memory {:#x}\n", mem);
       enable(KVM_CAP_X2APIC_API);
-      create_memory(mem);
+      create_memory(mem, shared_memory);
       create_irq_chip();
       create_pit();
 
+      irqfd_resample = ioctl(fd, KVM_CHECK_EXTENSION, KVM_CAP_IRQFD_RESAMPLE) > 0;
+      if (irqfd_resample) {
+        resample_fd = epoll_create1(0);
+        if (resample_fd < 0)
+          throw std::runtime_error(errno_msg("epoll_create1"));
+        resample_thread = std::thread(&vm::run_resample, this);
+      }
+
       for (size_t i = 0; i < ncpus; i++) {
         cpus.emplace_back(create_vcpu(k, i));
       }
+
+      // bios post codes
+      add_io_sink(0x80, 1);
     }
 
     ~vm() {
       should_run = false;
 
+      if (resample_thread.joinable()) {
+        resample_thread.join();
+        close(resample_fd);
+      }
+
       mmio.reset();
 
       munmap(memory, memory_size);
+      if (memory_fd >= 0) {
+        close(memory_fd);
+      }
     }
 
     __u8 *memory_ptr() {
       return memory;
     }
 
+    ::kvm::memory_map &memory_map() {
+      return guest_memory;
+    }
+
     vcpu &get_vcpu(size_t index) {
       return *cpus[index];
     }
@@ -93,18 +130,37 @@ namespace kvm {
 
     template <class device_type, typename... arg_types>
     device_type *add_io_device(__u64 addr, __u64 width, __u32 interrupt, arg_types &&... args) {
-      auto irq = register_irq(interrupt);
+      // legacy devices pulse their line, resampling is for level triggered ones
+      auto irq = register_irq(interrupt, false);
 
       auto ptr = new device_type{addr, width, irq, std::forward<arg_types>(args)...};
       io_devices.emplace_back(ptr);
+      map_io_ports(ptr, addr, width);
+
+      return ptr;
+    }
+
+    device::io_sink *add_io_sink(__u64 addr, __u64 width) {
+      auto ptr = new device::io_sink{addr, width, nullptr};
+      io_devices.emplace_back(ptr);
+      map_io_ports(ptr, addr, width);
 
       return ptr;
     }
 
     template <class device_type, typename... arg_types>
     void add_mmio_device(__u64 addr, __u64 width, __u32 interrupt, arg_types &&... args) {
-      auto irq = register_irq(interrupt);
-      mmio->add_device<device_type>(addr, width, irq, memory_ptr(), std::forward<arg_types>(args)...);
+      auto irq = register_irq(interrupt, irqfd_resample);
+      auto dev = mmio->add_device<device_type>(addr, width, irq, &guest_memory, std::forward<arg_types>(args)...);
+
+      // queue kicks are delivered straight to the device eventfds
+      auto &vdev = dev->virtio_device();
+      for (__u32 i = 0; i < vdev.num_queues(); i++) {
+        register_ioeventfd(addr + VIRTIO_MMIO_QUEUE_NOTIFY, sizeof(__u32), vdev.q(i).kick_fd(), KVM_IOEVENTFD_FLAG_DATAMATCH, i);
+      }
+
+      // as is the interrupt ack, the line itself is dropped on EOI
+      register_ioeventfd(addr + VIRTIO_MMIO_INTERRUPT_ACK, sizeof(__u32), irq->ack_fd(), KVM_IOEVENTFD_FLAG_DATAMATCH, 0x1);
     }
 
     void handle_io_device(kvm_run *kvm_run, device::io_device &dev) {
@@ -134,56 +190,7 @@ namespace kvm {
 
         switch (kvm_run->exit_reason) {
         case KVM_EXIT_IO:
-          for (auto &dev : io_devices) {
-            if (dev->in_range(kvm_run->io.port)) {
-              handle_io_device(kvm_run, *dev);
-              goto break_label;
-            }
-          }
-
-          /* currently breaks uart. no idea why
-          if (kvm_run->io.port == 0x70 && kvm_run->io.direction == KVM_EXIT_IO_OUT) {
-            auto data = (char *)kvm_run + kvm_run->io.data_offset;
-            auto offset = kvm_run->io.port - 0x70;
-            auto size = kvm_run->io.count * kvm_run->io.size;
-
-            rtc.write_index(data, offset, size);
-            break;
-          }
-
-          if (kvm_run->io.port == 0x71) {
-            auto offset = kvm_run->io.port - 0x71;
-
-            if (kvm_run->io.direction == KVM_EXIT_IO_IN) {
-              auto size = kvm_run->io.count * kvm_run->io.size;
-              auto buf = rtc.read(offset, size);
-
-              auto ptr = (char *)kvm_run + kvm_run->io.data_offset;
-              memcpy(ptr, buf.data(), buf.size());
-            } else if (kvm_run->io.direction == KVM_EXIT_IO_OUT) {
-              auto data = (char *)kvm_run + kvm_run->io.data_offset;
-              auto size = kvm_run->io.count * kvm_run->io.size;
-              rtc.write(data, offset, size);
-            }
-            break;
-          }
-          */
-
-          if (kvm_run->io.port == 0x80) {
-            // bios post codes
-            break;
-          }
-
-          fmt::print(
-              "kvm::vcpu::io {} port {:#x} offset {:#x} size {} ({}) value {:#x}\n",
-              kvm_run->io.direction == KVM_EXIT_IO_IN ? "in" : "out",
-              kvm_run->io.port,
-              kvm_run->io.data_offset,
-              kvm_run->io.size,
-              kvm_run->io.count,
-              *((char *)kvm_run + kvm_run->io.data_offset));
-
-        break_label:
+          handle_io_device(kvm_run, *io_ports[kvm_run->io.port]);
           break;
         case KVM_EXIT_MMIO: {
           if (!kvm_run->mmio.is_write) {
@@ -192,7 +199,6 @@ namespace kvm {
           } else {
             mmio->write(&kvm_run->mmio.data[0], kvm_run->mmio.phys_addr, kvm_run->mmio.len);
           }
-          mmio->update(memory_ptr());
           break;
         }
         case KVM_EXIT_DEBUG:
@@ -227,23 +233,34 @@ namespace kvm {
     }
 
   private:
-    void create_memory(size_t mem) {
+    void create_memory(size_t mem, bool shared) {
       memory_size = mem;
       if (mem >= KVM_32BIT_GAP_START) {
         memory_size += KVM_32BIT_GAP_SIZE;
       }
 
+      if (shared) {
+        memory_fd = memfd_create("kthxvm-memory", MFD_CLOEXEC);
+        if (memory_fd < 0)
+          throw std::runtime_error(errno_msg("memfd_create"));
+        if (ftruncate(memory_fd, memory_size) < 0)
+          throw std::runtime_error(errno_msg("memory ftruncate"));
+      }
+
       memory = reinterpret_cast<__u8 *>(mmap(
           NULL,
           memory_size,
-          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
-          -1,
+          PROT_READ | PROT_WRITE, (shared ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS) | MAP_NORESERVE,
+          memory_fd,
           0));
       if (memory == MAP_FAILED) {
         throw std::runtime_error("memory map failed");
       }
 
-      madvise(memory, memory_size, MADV_MERGEABLE);
+      // ksm only merges private anonymous memory
+      if (!shared) {
+        madvise(memory, memory_size, MADV_MERGEABLE);
+      }
 
       if (memory_size < KVM_32BIT_GAP_START) {
         struct kvm_userspace_memory_region memreg = {
@@ -255,6 +272,7 @@ namespace kvm {
         };
         if (ioctl(fd, KVM_SET_USER_MEMORY_REGION, &memreg) < 0)
           ioctl_err("KVM_SET_USER_MEMORY_REGION");
+        guest_memory.add_region(0, memory_size, memory, memory_fd, 0);
       } else {
         struct kvm_userspace_memory_region memreg = {
             0,
@@ -265,6 +283,7 @@ namespace kvm {
         };
         if (ioctl(fd, KVM_SET_USER_MEMORY_REGION, &memreg) < 0)
           ioctl_err("KVM_SET_USER_MEMORY_REGION");
+        guest_memory.add_region(0, KVM_32BIT_GAP_START, memory, memory_fd, 0);
 
         memreg = {
             1,
@@ -275,6 +294,8 @@ namespace kvm {
         };
         if (ioctl(fd, KVM_SET_USER_MEMORY_REGION, &memreg) < 0)
           ioctl_err("KVM_SET_USER_MEMORY_REGION");
+        guest_memory.add_region(KVM_32BIT_MAX_MEM_SIZE, memory_size - KVM_32BIT_MAX_MEM_SIZE, memory + KVM_32BIT_MAX_MEM_SIZE,
+                                memory_fd, KVM_32BIT_MAX_MEM_SIZE);
       }
 
       if (ioctl(fd, KVM_SET_TSS_ADDR, 0xfffbd000) < 0)
@@ -300,7 +321,32 @@ namespace kvm {
       return std::make_unique<vcpu>(vcpu_fd, vcpu_mmap_size);
     }
 
-    ::kvm::interrupt *register_irq(__u32 num) {
+    void map_io_ports(device::io_device *dev, __u64 addr, __u64 width) {
+      if (addr + width > IO_PORT_COUNT)
+        throw std::runtime_error(fmt::format("io device at {:#x} exceeds port space", addr));
+
+      for (__u64 port = addr; port < addr + width; port++) {
+        if (io_ports[port] != &unhandled_io)
+          throw std::runtime_error(fmt::format("io port {:#x} already claimed", port));
+        io_ports[port] = dev;
+      }
+    }
+
+    void register_ioeventfd(__u64 addr, __u32 len, int event_fd, __u32 flags = 0, __u64 datamatch = 0) {
+      struct kvm_ioeventfd ioeventfd = {};
+      ioeventfd.datamatch = datamatch;
+      ioeventfd.addr = addr;
+      ioeventfd.len = len;
+      ioeventfd.fd = event_fd;
+      ioeventfd.flags = flags;
+
+      if (ioctl(fd, KVM_IOEVENTFD, &ioeventfd) < 0)
+        ioctl_err("KVM_IOEVENTFD");
+    }
+
+    // a line shared by several devices keeps the mode it was first
+    // registered with
+    ::kvm::interrupt *register_irq(__u32 num, bool resample) {
       if (interrupts[num]) {
         return interrupts[num].get();
       }
@@ -314,24 +360,55 @@ namespace kvm {
           0,
           0,
       };
+      if (resample) {
+        irqfd.flags = KVM_IRQFD_FLAG_RESAMPLE;
+        irqfd.resamplefd = irq->resample_fd();
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = irq;
+        if (epoll_ctl(resample_fd, EPOLL_CTL_ADD, irq->resample_fd(), &ev) < 0)
+          throw std::runtime_error(errno_msg("epoll_ctl"));
+      }
       if (ioctl(fd, KVM_IRQFD, &irqfd) < 0)
         ioctl_err("KVM_IRQFD");
 
       return irq;
     }
 
+    void run_resample() {
+      std::array<struct epoll_event, 32> events;
+
+      while (should_run) {
+        int count = epoll_wait(resample_fd, events.data(), events.size(), 100);
+        for (int i = 0; i < count; i++) {
+          reinterpret_cast<::kvm::interrupt *>(events[i].data.ptr)->resampled();
+        }
+      }
+    }
+
     int fd;
 
     __u8 *memory;
     __u64 memory_size;
+    int memory_fd = -1;
+    ::kvm::memory_map guest_memory;
 
-    bool should_run = true;
+    std::atomic_bool should_run = true;
 
     std::array<std::unique_ptr<::kvm::interrupt>, 32> interrupts;
 
+    bool irqfd_resample = false;
+    int resample_fd = -1;
+    std::thread resample_thread;
+
     std::vector<std::unique_ptr<vcpu>> cpus;
     std::vector<std::unique_ptr<device::io_device>> io_devices;
 
+    // indexed by port, unclaimed ports point at unhandled_io
+    device::io_sink unhandled_io;
+    std::vector<device::io_device *> io_ports;
+
     std::unique_ptr<virtio::mmio> mmio;
   };
 
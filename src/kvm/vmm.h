@@ -3,6 +3,7 @@
 #include <atomic>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <thread>
 
 #include <asm/bootparam.h>
@@ -25,6 +26,7 @@
 #include "virtio/blk.h"
 #include "virtio/net.h"
 #include "virtio/rng.h"
+#include "virtio/vhost_user_blk.h"
 
 namespace kvm {
 
@@ -33,12 +35,19 @@ namespace kvm {
     static constexpr __u64 CPU_COUNT = 2;
     static constexpr __u64 MEMORY_SIZE_MB = 4 * 1024ul;
     static constexpr __u64 MB_SHIFT = (20);
+    static constexpr std::string_view VHOST_USER_PREFIX = "vhost-user:";
 
-    vmm()
+    // a vhost-user disk needs guest memory it can map, see vhost_user_disk
+    explicit vmm(bool shared_memory = false)
         : run_terminal(true)
         , kvm()
         , term()
-        , vm(kvm, CPU_COUNT, MEMORY_SIZE_MB << MB_SHIFT) {}
+        , vm(kvm, CPU_COUNT, MEMORY_SIZE_MB << MB_SHIFT, shared_memory) {}
+
+    // "vhost-user:<socket>" hands the disk to a backend process
+    static bool vhost_user_disk(const std::string &disk) {
+      return disk.rfind(VHOST_USER_PREFIX, 0) == 0;
+    }
 
     int start(std::string kernel, std::string disk) {
       std::string cmdline = "console=ttyS0";
@@ -78,7 +87,11 @@ namespace kvm {
       vm.add_io_device<device::uart>(0x3e8, 8, 4, nullptr);       // ttyS2
       vm.add_io_device<device::uart>(0x2e8, 8, 3, nullptr);       // ttyS3
 
-      vm.add_mmio_device<virtio::blk>(0xd0000000, 0x1000, 12, disk);
+      if (vhost_user_disk(disk)) {
+        vm.add_mmio_device<virtio::vhost_user_blk>(0xd0000000, 0x1000, 12, disk.substr(VHOST_USER_PREFIX.size()));
+      } else {
+        vm.add_mmio_device<virtio::blk>(0xd0000000, 0x1000, 12, disk);
+      }
       vm.add_mmio_device<virtio::rng>(0xd0001000, 0x1000, 13);
       vm.add_mmio_device<virtio::net>(0xd0002000, 0x1000, 14);
 
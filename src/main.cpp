@@ -1,6 +1,7 @@
 #include "kvm/vmm.h"
 
 int main(int argc, char **argv) {
-  kvm::vmm vmm;
-  return vmm.start("guest/new-vmlinux", "guest/debian.ext4");
+  const std::string disk = "guest/debian.ext4";
+  kvm::vmm vmm(kvm::vmm::vhost_user_disk(disk));
+  return vmm.start("guest/new-vmlinux", disk);
 }
\ No newline at end of file
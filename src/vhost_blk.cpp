@@ -0,0 +1,68 @@
+#include <stdexcept>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kvm/virtio/vhost_user_backend.h"
+
+// a vhost-user-blk backend serving a disk spec on a unix socket, one
+// frontend at a time:
+//
+//   kthxvm-vhost-blk <socket> <disk spec>
+//
+// the vmm uses it for a disk given as "vhost-user:<socket>".
+
+namespace {
+  int listen_on(const std::string &path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      throw std::runtime_error(fmt::format("socket path {} is too long", path));
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      throw std::runtime_error(kvm::errno_msg("socket"));
+
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+      throw std::runtime_error(kvm::errno_msg(fmt::format("bind {}", path)));
+    if (listen(fd, 1) < 0)
+      throw std::runtime_error(kvm::errno_msg("listen"));
+    return fd;
+  }
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fmt::print("usage: {} <socket> <disk spec>\n", argv[0]);
+    return 1;
+  }
+
+  const auto opts = kvm::block::options::parse(argv[2]);
+  const int srv = listen_on(argv[1]);
+  fmt::print("kthxvm-vhost-blk serving {} on {}\n", opts.path, argv[1]);
+
+  while (true) {
+    const int fd = accept4(srv, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(kvm::errno_msg("accept"));
+    }
+
+    // a broken frontend only ends its own session
+    try {
+      kvm::virtio::vhost_user_blk_backend backend(fd, opts);
+      backend.run();
+      fmt::print("kthxvm-vhost-blk frontend disconnected\n");
+    } catch (const std::exception &e) {
+      fmt::print("kthxvm-vhost-blk session failed: {}\n", e.what());
+    }
+  }
+}